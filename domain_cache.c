@@ -0,0 +1,25 @@
+#include "domain_cache.h"
+
+void domain_cache_init(domain_cache_t *c, u32 log2_sets)
+{
+    c->sets = 0;
+    vec_validate_aligned(c->sets, (1 << log2_sets) - 1, CLIB_CACHE_LINE_BYTES);
+    c->seed = clib_cpu_time_now() * 0x9e3779b97f4a7c15ULL;
+    c->hits = 0;
+    c->misses = 0;
+    c->miss_clocks = 0;
+}
+
+void domain_cache_free(domain_cache_t *c)
+{
+    vec_free(c->sets);
+}
+
+u8 *format_domain_cache(u8 *s, va_list *args)
+{
+    domain_cache_t *c = va_arg(*args, domain_cache_t *);
+    u64 lookups = c->hits + c->misses;
+
+    return format(s, "%llu lookups, hit ratio %.3f, %.0f clocks per miss", lookups,
+                  lookups ? (f64)c->hits / lookups : 0.0, c->misses ? (f64)c->miss_clocks / c->misses : 0.0);
+}
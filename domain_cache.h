@@ -0,0 +1,85 @@
+#ifndef DOMAIN_CACHE_H
+#define DOMAIN_CACHE_H
+
+#include <vppinfra/clib.h>
+#include <vppinfra/format.h>
+#include <vppinfra/hash.h>
+#include <vppinfra/time.h>
+#include <vppinfra/types.h>
+#include <vppinfra/vec.h>
+
+#define DOMAIN_CACHE_WAYS 4
+#define DOMAIN_CACHE_LOG2_SETS 12 /* 16K entries in 256 KB */
+
+/* One set per cache line, a zero tag is an empty way */
+typedef struct {
+    u64 tag[DOMAIN_CACHE_WAYS];
+    u64 value[DOMAIN_CACHE_WAYS];
+} domain_cache_set_t;
+
+/*
+ * Per-thread cache of lookup results in front of one table, keyed by a
+ * hash of the SNI as received and of the table's generation. The table
+ * bumps its generation on every change, which moves all lookups to new
+ * keys: stale entries are never hit again and age out, and no thread has
+ * to be told.
+ */
+typedef struct {
+    domain_cache_set_t *sets; /* vec, cache line aligned */
+    u64 seed;                 /* keeps tags from being made to collide */
+    u64 hits;
+    u64 misses;
+    u64 miss_clocks;          /* CPU clocks of the table lookups behind the misses */
+} domain_cache_t;
+
+void domain_cache_init(domain_cache_t *c, u32 log2_sets);
+void domain_cache_free(domain_cache_t *c);
+u8 *format_domain_cache(u8 *s, va_list *args);
+
+static_always_inline u64 domain_cache_key(domain_cache_t *c, const u8 *sni, uword len, u64 generation)
+{
+    u64 key = hash_memory((void *)sni, len, c->seed ^ generation);
+
+    return key ? key : 1;
+}
+
+static_always_inline domain_cache_set_t *domain_cache_set(domain_cache_t *c, u64 key)
+{
+    return c->sets + (key & (vec_len(c->sets) - 1));
+}
+
+static_always_inline int domain_cache_get(domain_cache_t *c, u64 key, u64 *value)
+{
+    domain_cache_set_t *set = domain_cache_set(c, key);
+
+    for (u32 i = 0; i < DOMAIN_CACHE_WAYS; i++) {
+        if (set->tag[i] == key) {
+            *value = set->value[i];
+            c->hits++;
+            return 1;
+        }
+    }
+
+    c->misses++;
+    return 0;
+}
+
+/* Fill an empty way, or evict one picked by the miss count */
+static_always_inline void domain_cache_put(domain_cache_t *c, u64 key, u64 value, u64 miss_start)
+{
+    domain_cache_set_t *set = domain_cache_set(c, key);
+    u32 way = c->misses % DOMAIN_CACHE_WAYS;
+
+    for (u32 i = 0; i < DOMAIN_CACHE_WAYS; i++) {
+        if (set->tag[i] == 0) {
+            way = i;
+            break;
+        }
+    }
+
+    set->tag[way] = key;
+    set->value[way] = value;
+    c->miss_clocks += clib_cpu_time_now() - miss_start;
+}
+
+#endif
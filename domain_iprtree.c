@@ -2,6 +2,7 @@
 #include "sniproxy.h"
 #include "vppinfra/format.h"
 #include <stdio.h>
+#include <pthread.h>
 
 void do_init();
 
@@ -25,19 +26,35 @@ sniproxy_prepare_pattern (u8 *pattern)
   else
     {
       /* Trim the wildcard character, it is useless */
-      clib_memmove (pattern, pattern + 1, len);
+      clib_memmove (pattern, pattern + 1, len - 1);
       vec_dec_len (pattern, 1);
     }
   return pattern;
 }
 
+/* The prepared strings and targets of patterns, for iprtree_build() */
+static iprtree_pattern_t *
+sniproxy_table_patterns (sniproxy_main_t *sm, u32 *pattern_indices)
+{
+  iprtree_pattern_t *patterns = 0, *p;
+  sniproxy_pattern_t *pattern;
+
+  vec_add2 (patterns, p, vec_len (pattern_indices));
+  for (u32 i = 0; i < vec_len (pattern_indices); i++)
+    {
+      pattern = sniproxy_pattern_get (sm, pattern_indices[i]);
+      p[i].str = pattern->str;
+      p[i].target = pattern->backend_set_index;
+    }
+  return patterns;
+}
+
 void
 sniproxy_table_rebuild (sniproxy_main_t *sm, sniproxy_table_t *table)
 {
   iprtree_container_t *container = &sm->iprtree_container;
   iprtree_t *tree = &table->tree;
-  sniproxy_pattern_t *pattern;
-  u32 *pattern_index;
+  iprtree_pattern_t *patterns;
 
   /* Empty the tree */
   iprtree_clear (container, tree);
@@ -45,12 +62,9 @@ sniproxy_table_rebuild (sniproxy_main_t *sm, sniproxy_table_t *table)
   /* Create root node */
   tree->iprtree_root_node_index = iprtree_allocate_internal_node (container);
 
-  vec_foreach (pattern_index, table->pattern_indices)
-    {
-      pattern = sniproxy_pattern_get (sm, pattern_index[0]);
-      iprtree_insert_pattern (container, tree, pattern->str,
-			      pattern->backend_set_index);
-    }
+  patterns = sniproxy_table_patterns (sm, table->pattern_indices);
+  iprtree_build (container, tree, patterns);
+  vec_free (patterns);
 };
 
 
@@ -62,33 +76,150 @@ void domain_iprtree_init(sniproxy_main_t *sm)
     u64 table_id = table - sm->tables;
       /* Initialise underlying structure */
     table->tree.iprtree_root_node_index = IPRTREE_INVALID_INDEX;
+    table->pattern_by_str = hash_create_vec (0, sizeof (u8), sizeof (uword));
     do_init();
 }
 
-void domain_iprtree_insert(sniproxy_main_t *sm, const char *domain, u64 backendsets)
+/* The prepared string of a pattern, lowercased and checked the way lookups
+ * are. NULL if it is invalid, or has a wildcard past its first label. */
+static u8 *
+domain_iprtree_pattern_str (const char *domain)
+{
+  u8 normalized[DOMAIN_MAX + 1], *str = 0;
+  u64 dots[4];
+  word len = domain_normalize_pattern ((const u8 *) domain,
+				       strnlen (domain, DOMAIN_MAX + 2),
+				       normalized, dots);
+
+  if (len <= 0 || memchr (normalized + 1, '*', len - 1))
+    return NULL;
+  vec_add (str, normalized, len);
+  return sniproxy_prepare_pattern (str);
+}
+
+/* Record a pattern from domain_iprtree_pattern_str() in the table, which
+ * takes str, or update the backend set of the same pattern if it is already
+ * there */
+static void
+domain_iprtree_pattern_set (sniproxy_main_t *sm, sniproxy_table_t *table,
+			    u8 *str, u64 backendsets)
+{
+  sniproxy_pattern_t *pattern;
+  uword *p;
+
+  p = hash_get_mem (table->pattern_by_str, str);
+  if (p)
+    {
+      pattern = sniproxy_pattern_get (sm, table->pattern_indices[p[0]]);
+      pattern->backend_set_index = backendsets;
+      vec_free (str);
+      return;
+    }
+
+  pool_get_zero (sm->patterns, pattern);
+  pattern->backend_set_index = backendsets;
+  /* Wildcard fallbacks are default leaves in the tree, so add and delete
+   * never need the covering links */
+  pattern->covering_child_index = IPRTREE_INVALID_INDEX;
+  pattern->covering_next_index = IPRTREE_INVALID_INDEX;
+  pattern->covering_parent_index = IPRTREE_INVALID_INDEX;
+  pattern->str = str;
+
+  vec_add1 (table->pattern_indices, pattern - sm->patterns);
+  hash_set_mem (table->pattern_by_str, pattern->str,
+		vec_len (table->pattern_indices) - 1);
+}
+
+int domain_iprtree_insert(sniproxy_main_t *sm, const char *domain, u64 backendsets)
 {
     sniproxy_table_t *table;
-    sniproxy_pattern_t *pattern;
     u32 table_id = 0;
-    clib_error_t *err;
-    word i;
-    u32 pattern_index;
-    if ((table = sniproxy_table_get(sm, table_id)) == NULL)
+    u8 *str;
+
+    if ((table = sniproxy_table_get(sm, table_id)) == NULL) {
         fformat(stderr, "table with index: %u not found", 0);
+        return -1;
+    }
+
+    if ((str = domain_iprtree_pattern_str (domain)) == NULL)
+        return -1;
+    domain_iprtree_pattern_set (sm, table, str, backendsets);
+    return 0;
+}
+
+/* Insert a pattern into the live tree right away, no commit needed */
+int
+domain_iprtree_add (sniproxy_main_t *sm, const char *domain, u64 backendsets)
+{
+  iprtree_container_t *container = &sm->iprtree_container;
+  sniproxy_table_t *table = sniproxy_table_get (sm, 0);
+  iprtree_t *tree;
+  u8 *str;
+
+  if (!table || !(str = domain_iprtree_pattern_str (domain)))
+    return -1;
+
+  /* The tree first, so a pattern it refuses never reaches the table */
+  tree = &table->tree;
+  if (tree->iprtree_root_node_index == IPRTREE_INVALID_INDEX)
+    tree->iprtree_root_node_index = iprtree_allocate_internal_node (container);
+  if (iprtree_insert_pattern (container, tree, str, backendsets) < 0)
+    {
+      vec_free (str);
+      return -1;
+    }
+
+  domain_iprtree_pattern_set (sm, table, str, backendsets);
+  __atomic_store_n (&table->generation, table->generation + 1,
+		    __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Remove a pattern from the table and the live tree. Lookups it covered fall
+ * back to the next wildcard up the tree on their own. */
+int
+domain_iprtree_delete (sniproxy_main_t *sm, const char *domain)
+{
+  sniproxy_table_t *table = sniproxy_table_get (sm, 0);
+  u8 *str = domain_iprtree_pattern_str (domain);
+  sniproxy_pattern_t *pattern;
+  u32 slot, last;
+  uword *p;
+
+  if (!table || !str)
+    {
+      vec_free (str);
+      return -1;
+    }
+  p = hash_get_mem (table->pattern_by_str, str);
+  vec_free (str);
+  if (!p)
+    return -1;
+
+  slot = p[0];
+  pattern = sniproxy_pattern_get (sm, table->pattern_indices[slot]);
+  /* Fails only for a pattern from domain_iprtree_insert() that no commit
+   * has put in the tree yet, which only the table has to forget */
+  iprtree_delete_pattern (&sm->iprtree_container, &table->tree,
+			  pattern->str);
+  hash_unset_mem (table->pattern_by_str, pattern->str);
 
-    pool_get_zero (sm->patterns, pattern);
-    pattern_index = pattern - sm->patterns;
-    pattern->backend_set_index = backendsets;
-      /* TODO cover management and incremental insertion deletion */
-    pattern->covering_child_index = IPRTREE_INVALID_INDEX;
-    pattern->covering_next_index = IPRTREE_INVALID_INDEX;
-    pattern->covering_parent_index = IPRTREE_INVALID_INDEX;
-    pattern->str = format (0, "%.256s", domain);
-    pattern->str = sniproxy_prepare_pattern (pattern->str);
-
-    vec_add1 (table->pattern_indices, pattern_index);
-    /*args->table_pattern_id = pattern_index;*/
+  /* Keep pattern_indices dense: the last pattern takes the freed slot */
+  last = vec_pop (table->pattern_indices);
+  if (slot < vec_len (table->pattern_indices))
+    {
+      table->pattern_indices[slot] = last;
+      hash_set_mem (table->pattern_by_str,
+		    sniproxy_pattern_get (sm, last)->str, slot);
+    }
+
+  vec_free (pattern->str);
+  pool_put (sm->patterns, pattern);
+  __atomic_store_n (&table->generation, table->generation + 1,
+		    __ATOMIC_RELEASE);
+  return 0;
 }
+
 void domain_iprtree_commit(sniproxy_main_t *sm)
 {
     sniproxy_table_t *table;
@@ -97,6 +228,128 @@ void domain_iprtree_commit(sniproxy_main_t *sm)
     if ((table = sniproxy_table_get(sm, table_id)) == NULL)
         fformat(stderr, "table with index: %u not found", 0);
     sniproxy_table_rebuild (sm, table);
+    __atomic_store_n (&table->generation, table->generation + 1,
+		      __ATOMIC_RELEASE);
+}
+
+typedef struct
+{
+  sniproxy_main_t *sm;
+  u32 *pattern_indices; /* vec, whole root buckets */
+  iprtree_container_t container;
+  iprtree_t tree;
+  pthread_t thread;
+  u8 joinable; /* built on its own thread, not the caller's */
+} domain_iprtree_builder_t;
+
+static void *
+domain_iprtree_build (void *arg)
+{
+  domain_iprtree_builder_t *b = arg;
+  iprtree_pattern_t *patterns;
+
+  b->tree.iprtree_root_node_index =
+    iprtree_allocate_internal_node (&b->container);
+  patterns = sniproxy_table_patterns (b->sm, b->pattern_indices);
+  iprtree_build (&b->container, &b->tree, patterns);
+  vec_free (patterns);
+  return 0;
+}
+
+/*
+ * domain_iprtree_commit() on n_threads cores. Patterns only ever meet under
+ * the root child of the first char they consume, their last one, so each
+ * such bucket is built whole by one thread in its own container. Buckets go
+ * largest first to the least loaded thread, then the subtrees are spliced
+ * under a fresh root. The tree comes out the same as a serial commit.
+ */
+void
+domain_iprtree_commit_parallel (sniproxy_main_t *sm, u32 n_threads)
+{
+  sniproxy_table_t *table = sniproxy_table_get (sm, 0);
+  iprtree_container_t *container = &sm->iprtree_container;
+  iprtree_t *tree = &table->tree;
+  u32 *buckets[IPRTREE_ARITY] = { 0 }, order[IPRTREE_ARITY];
+  domain_iprtree_builder_t *builders = 0, *b;
+  u32 *serial = 0, *pattern_index;
+  sniproxy_pattern_t *pattern;
+
+  if (n_threads <= 1)
+    {
+      domain_iprtree_commit (sm);
+      return;
+    }
+
+  vec_foreach (pattern_index, table->pattern_indices)
+    {
+      pattern = sniproxy_pattern_get (sm, pattern_index[0]);
+      u8 c = vec_len (pattern->str) ?
+	       iprtree_conversion[vec_end (pattern->str)[-1]] :
+	       (u8) ~0;
+      /* The root wildcard, or chars the tree does not take, which the
+       * insert refuses */
+      if (c == (u8) ~0)
+	vec_add1 (serial, pattern_index[0]);
+      else
+	vec_add1 (buckets[c], pattern_index[0]);
+    }
+
+  for (u32 i = 0; i < IPRTREE_ARITY; i++)
+    order[i] = i;
+  for (u32 i = 1; i < IPRTREE_ARITY; i++)
+    for (u32 j = i; j > 0 && vec_len (buckets[order[j]]) >
+			       vec_len (buckets[order[j - 1]]);
+	 j--)
+      {
+	u32 tmp = order[j];
+	order[j] = order[j - 1];
+	order[j - 1] = tmp;
+      }
+
+  vec_validate (builders, n_threads - 1);
+  for (u32 i = 0; i < IPRTREE_ARITY && vec_len (buckets[order[i]]); i++)
+    {
+      domain_iprtree_builder_t *least = builders;
+      vec_foreach (b, builders)
+	if (vec_len (b->pattern_indices) < vec_len (least->pattern_indices))
+	  least = b;
+      vec_append (least->pattern_indices, buckets[order[i]]);
+      vec_free (buckets[order[i]]);
+    }
+
+  vec_foreach (b, builders)
+    {
+      b->sm = sm;
+      /* Out of threads, the caller builds it after its own */
+      if (b > builders)
+	b->joinable =
+	  pthread_create (&b->thread, NULL, domain_iprtree_build, b) == 0;
+    }
+  vec_foreach (b, builders)
+    if (!b->joinable)
+      domain_iprtree_build (b);
+
+  iprtree_clear (container, tree);
+  tree->iprtree_root_node_index = iprtree_allocate_internal_node (container);
+  vec_foreach (b, builders)
+    {
+      if (b->joinable)
+	pthread_join (b->thread, NULL);
+      iprtree_splice (container, tree, &b->container, &b->tree);
+      vec_free (b->pattern_indices);
+    }
+  vec_free (builders);
+
+  vec_foreach (pattern_index, serial)
+    {
+      pattern = sniproxy_pattern_get (sm, pattern_index[0]);
+      iprtree_insert_pattern (container, tree, pattern->str,
+			      pattern->backend_set_index);
+    }
+  vec_free (serial);
+
+  __atomic_store_n (&table->generation, table->generation + 1,
+		    __ATOMIC_RELEASE);
 }
 
 u64 domain_iprtree_search(sniproxy_main_t *sm, const char *domain)
@@ -111,14 +364,38 @@ u64 domain_iprtree_search(sniproxy_main_t *sm, const char *domain)
     if (tree->iprtree_root_node_index == IPRTREE_INVALID_INDEX)
       return -1;
 
-    u8 * sni = format(0, "%s%c", domain, 0);
-    clib_memmove (sni + 1, sni, vec_len (sni) - 1);
+    /* Normalize straight into the lookup buffer, behind the terminator */
+    u8 sni[DOMAIN_MAX + 2];
+    u64 dots[4];
+    word len = domain_normalize ((const u8 *) domain,
+				 strnlen (domain, DOMAIN_MAX + 2), sni + 1, dots);
+    if (len < 0)
+      return -1;
     sni[0] = 0;
-    tgt = iprtree_lookup (&sm->iprtree_container, tree, sni, vec_len(sni));
+    tgt = iprtree_lookup (&sm->iprtree_container, tree, sni, len + 1);
 
     if (tgt == IPRTREE_INVALID_INDEX)
       return -1;
 
-    vec_free(sni);
     return tgt;
 }
+
+/* domain_iprtree_search() through the calling thread's cache */
+u64
+domain_iprtree_search_cached (sniproxy_main_t *sm, domain_cache_t *cache,
+			      const char *domain)
+{
+  sniproxy_table_t *table = sniproxy_table_get (sm, 0);
+  u64 generation = __atomic_load_n (&table->generation, __ATOMIC_ACQUIRE);
+  uword len = strnlen (domain, DOMAIN_MAX + 2);
+  u64 key = domain_cache_key (cache, (const u8 *) domain, len, generation);
+  u64 backendsets;
+
+  if (domain_cache_get (cache, key, &backendsets))
+    return backendsets;
+
+  u64 start = clib_cpu_time_now ();
+  backendsets = domain_iprtree_search (sm, domain);
+  domain_cache_put (cache, key, backendsets, start);
+  return backendsets;
+}
@@ -14,11 +14,18 @@
 #include <vppinfra/bihash_8_8.h>
 #include <vppinfra/bihash_template.h>
 #include "sniproxy.h"
+#include "domain_cache.h"
+#include "domain_labels.h"
 
 
 void domain_iprtree_init(sniproxy_main_t *sm);
-void domain_iprtree_insert(sniproxy_main_t *sm, const char *domain, u64 backendsets);
+int domain_iprtree_insert(sniproxy_main_t *sm, const char *domain, u64 backendsets);
+int domain_iprtree_add(sniproxy_main_t *sm, const char *domain, u64 backendsets);
+int domain_iprtree_delete(sniproxy_main_t *sm, const char *domain);
 u64 domain_iprtree_search(sniproxy_main_t *sm, const char *domain);
+u64 domain_iprtree_search_cached(sniproxy_main_t *sm, domain_cache_t *cache,
+				 const char *domain);
 void domain_iprtree_commit(sniproxy_main_t *sm);
+void domain_iprtree_commit_parallel(sniproxy_main_t *sm, u32 n_threads);
 
 #endif
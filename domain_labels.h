@@ -0,0 +1,306 @@
+#ifndef DOMAIN_LABELS_H
+#define DOMAIN_LABELS_H
+
+#include <vppinfra/clib.h>
+#include <vppinfra/crc32.h>
+#include <vppinfra/types.h>
+#include <vppinfra/vector.h>
+
+#define DOMAIN_MAX 253
+#define LABEL_MAX 63
+#define LABELS_MAX ((DOMAIN_MAX + 1) / 2)
+
+/*
+ * Label hash functions. crc32c is one instruction per 8 bytes but only 32
+ * bits wide, so a few million labels make collision chains routine, and it
+ * is linear: colliding labels are easy to build on purpose. The crc32c
+ * pair adds a second lane over the words multiplied first, which is not
+ * linear, so labels built to collide in the first lane are back to 32
+ * random bits. fast64 is a multiply-fold hash. All three are always
+ * defined; DOMAIN_LABEL_HASH picks the one the tries are built with.
+ */
+#define DOMAIN_LABEL_HASH_CRC32C 1
+#define DOMAIN_LABEL_HASH_CRC32C_PAIR 2
+#define DOMAIN_LABEL_HASH_FAST64 3
+
+#ifndef DOMAIN_LABEL_HASH
+#define DOMAIN_LABEL_HASH DOMAIN_LABEL_HASH_CRC32C
+#endif
+
+#if DOMAIN_LABEL_HASH == DOMAIN_LABEL_HASH_CRC32C
+typedef u32 domain_label_hash_t;
+#define domain_label_hash domain_label_hash_crc32c
+#define DOMAIN_LABEL_HASH_NAME "crc32c"
+#elif DOMAIN_LABEL_HASH == DOMAIN_LABEL_HASH_CRC32C_PAIR
+typedef u64 domain_label_hash_t;
+#define domain_label_hash domain_label_hash_crc32c_pair
+#define DOMAIN_LABEL_HASH_NAME "crc32c pair"
+#elif DOMAIN_LABEL_HASH == DOMAIN_LABEL_HASH_FAST64
+typedef u64 domain_label_hash_t;
+#define domain_label_hash domain_label_hash_fast64
+#define DOMAIN_LABEL_HASH_NAME "fast64"
+#else
+#error "unknown DOMAIN_LABEL_HASH"
+#endif
+
+#define DOMAIN_LABEL_HASH_SEED 0x2d358dccaa6c78a5ULL
+
+/* Labels of a domain, rightmost one first, empty labels skipped */
+typedef struct {
+    u32 n_labels;
+    u8 offset[LABELS_MAX];
+    u8 len[LABELS_MAX];
+    domain_label_hash_t hash[LABELS_MAX]; /* domain_label_hash() of the label bytes */
+} domain_labels_t;
+
+static_always_inline u32 domain_label_hash_crc32c(const u8 *label, uword len)
+{
+    return clib_crc32c(label, len);
+}
+
+/* The last len % 8 bytes, without reading past them */
+static_always_inline u64 domain_label_tail(const u8 *p, uword len)
+{
+    u64 w = 0;
+
+    if (len & 4) {
+        w = clib_mem_unaligned(p, u32);
+        p += 4;
+    }
+    if (len & 2) {
+        w = w << 16 | clib_mem_unaligned(p, u16);
+        p += 2;
+    }
+    if (len & 1)
+        w = w << 8 | *p;
+    return w;
+}
+
+static_always_inline u64 domain_label_hash_crc32c_pair(const u8 *label, uword len)
+{
+    u32 lo = 0, hi = len;
+    u64 w;
+
+    for (; len >= 8; label += 8, len -= 8) {
+        w = clib_mem_unaligned(label, u64);
+        lo = clib_crc32c_u64(lo, w);
+        hi = clib_crc32c_u64(hi, w * 0x9e3779b97f4a7c15ULL);
+    }
+    if (len) {
+        w = domain_label_tail(label, len);
+        lo = clib_crc32c_u64(lo, w);
+        hi = clib_crc32c_u64(hi, w * 0x9e3779b97f4a7c15ULL);
+    }
+    return (u64)hi << 32 | lo;
+}
+
+/* Both halves of the 128-bit product folded together */
+static_always_inline u64 domain_label_mum(u64 a, u64 b)
+{
+    unsigned __int128 r = (unsigned __int128)a * b;
+
+    return (u64)r ^ (u64)(r >> 64);
+}
+
+static_always_inline u64 domain_label_hash_fast64(const u8 *label, uword len)
+{
+    u64 h = DOMAIN_LABEL_HASH_SEED ^ len;
+
+    for (; len >= 8; label += 8, len -= 8)
+        h = domain_label_mum(h ^ clib_mem_unaligned(label, u64), 0x9e3779b97f4a7c15ULL);
+    if (len)
+        h = domain_label_mum(h ^ domain_label_tail(label, len), 0x9e3779b97f4a7c15ULL);
+    return domain_label_mum(h, 0xff51afd7ed558ccdULL);
+}
+
+/* Set bit i of dots for every '.' at domain[i], len <= DOMAIN_MAX */
+static_always_inline void domain_dot_bitmap(const u8 *domain, uword len, u64 dots[4])
+{
+    uword i = 0;
+
+    dots[0] = dots[1] = dots[2] = dots[3] = 0;
+
+#if defined(CLIB_HAVE_VEC256)
+    for (; i + 32 <= len; i += 32) {
+        u8x32 v = u8x32_load_unaligned(domain + i);
+        u64 m = u8x32_msb_mask((u8x32)(v == u8x32_splat('.')));
+        dots[i / 64] |= m << (i % 64);
+    }
+#endif
+#if defined(CLIB_HAVE_VEC128)
+    for (; i + 16 <= len; i += 16) {
+        u8x16 v = u8x16_load_unaligned(domain + i);
+        u64 m = u8x16_msb_mask((u8x16)(v == u8x16_splat('.')));
+        dots[i / 64] |= m << (i % 64);
+    }
+#endif
+    for (; i < len; i++)
+        dots[i / 64] |= (u64)(domain[i] == '.') << (i % 64);
+}
+
+/*
+ * Walk the dot bitmap from the right to emit every label's offset and
+ * length, then hash all labels in a single sweep. Returns the number of
+ * labels, or -1 if a label is longer than LABEL_MAX.
+ */
+static_always_inline int domain_labels_from_dots(const u8 *domain, uword len, const u64 dots[4],
+                                                 domain_labels_t *labels)
+{
+    uword end = len;
+    u32 n = 0;
+
+    for (int w = 3; w >= 0; w--) {
+        u64 m = dots[w];
+        while (m) {
+            uword dot = w * 64 + min_log2(m);
+            m ^= 1ULL << (dot % 64);
+            if (dot + 1 < end) {
+                if (end - dot - 1 > LABEL_MAX)
+                    return -1;
+                labels->offset[n] = dot + 1;
+                labels->len[n] = end - dot - 1;
+                n++;
+            }
+            end = dot;
+        }
+    }
+    if (end > 0) {
+        if (end > LABEL_MAX)
+            return -1;
+        labels->offset[n] = 0;
+        labels->len[n] = end;
+        n++;
+    }
+
+    for (u32 i = 0; i < n; i++)
+        labels->hash[i] = domain_label_hash(domain + labels->offset[i], labels->len[i]);
+
+    labels->n_labels = n;
+    return n;
+}
+
+/*
+ * Split a domain into labels with one vector pass for the '.' positions.
+ * Returns -1 if it is longer than DOMAIN_MAX.
+ */
+static_always_inline int domain_labels_split(const u8 *domain, uword len, domain_labels_t *labels)
+{
+    u64 dots[4];
+
+    if (len > DOMAIN_MAX)
+        return -1;
+    domain_dot_bitmap(domain, len, dots);
+    return domain_labels_from_dots(domain, len, dots, labels);
+}
+
+/*
+ * Lowercase a lookup into out (at least DOMAIN_MAX + 1 bytes) and build its
+ * dot bitmap in the same pass, rejecting any byte that does not lowercase
+ * into IPRTREE_ALLOWED_CHARS. A trailing root dot is stripped. Returns the
+ * normalized length, or -1 if the domain is invalid, too long, or has an
+ * empty label or one longer than LABEL_MAX.
+ */
+static_always_inline word domain_normalize(const u8 *domain, uword len, u8 *out, u64 dots[4])
+{
+    uword i = 0;
+
+    if (len > DOMAIN_MAX + 1)
+        return -1;
+
+    dots[0] = dots[1] = dots[2] = dots[3] = 0;
+
+#if defined(CLIB_HAVE_VEC256)
+    for (; i + 32 <= len; i += 32) {
+        u8x32 v = u8x32_load_unaligned(domain + i);
+        v |= (u8x32)((u8x32)(v - u8x32_splat('A')) < u8x32_splat(26)) & u8x32_splat(0x20);
+        u8x32 dot = (u8x32)(v == u8x32_splat('.'));
+        u8x32 ok = (u8x32)((u8x32)(v - u8x32_splat('a')) < u8x32_splat(26)) |
+                   (u8x32)((u8x32)(v - u8x32_splat('0')) < u8x32_splat(10)) |
+                   (u8x32)(v == u8x32_splat('-')) | dot;
+        if (u8x32_msb_mask(ok) != 0xffffffff)
+            return -1;
+        u8x32_store_unaligned(v, out + i);
+        dots[i / 64] |= (u64)u8x32_msb_mask(dot) << (i % 64);
+    }
+#endif
+#if defined(CLIB_HAVE_VEC128)
+    for (; i + 16 <= len; i += 16) {
+        u8x16 v = u8x16_load_unaligned(domain + i);
+        v |= (u8x16)((u8x16)(v - u8x16_splat('A')) < u8x16_splat(26)) & u8x16_splat(0x20);
+        u8x16 dot = (u8x16)(v == u8x16_splat('.'));
+        u8x16 ok = (u8x16)((u8x16)(v - u8x16_splat('a')) < u8x16_splat(26)) |
+                   (u8x16)((u8x16)(v - u8x16_splat('0')) < u8x16_splat(10)) |
+                   (u8x16)(v == u8x16_splat('-')) | dot;
+        if (u8x16_msb_mask(ok) != 0xffff)
+            return -1;
+        u8x16_store_unaligned(v, out + i);
+        dots[i / 64] |= (u64)u8x16_msb_mask(dot) << (i % 64);
+    }
+#endif
+    for (; i < len; i++) {
+        u8 c = domain[i];
+        if ((u8)(c - 'A') < 26)
+            c |= 0x20;
+        if (!((u8)(c - 'a') < 26 || (u8)(c - '0') < 10 || c == '-' || c == '.'))
+            return -1;
+        out[i] = c;
+        dots[i / 64] |= (u64)(c == '.') << (i % 64);
+    }
+
+    if (len && out[len - 1] == '.') {
+        len--;
+        dots[len / 64] &= ~(1ULL << (len % 64));
+    }
+
+    if (len > DOMAIN_MAX)
+        return -1;
+
+    /* Labels are the gaps between consecutive dots, 1..LABEL_MAX bytes each */
+    word prev = -1;
+    for (int w = 0; w < 4; w++) {
+        for (u64 m = dots[w]; m; m &= m - 1) {
+            word dot = w * 64 + count_trailing_zeros(m);
+            if ((uword)(dot - prev - 2) >= LABEL_MAX)
+                return -1;
+            prev = dot;
+        }
+    }
+    if ((uword)((word)len - prev - 2) >= LABEL_MAX)
+        return -1;
+
+    return len;
+}
+
+/*
+ * domain_normalize() for a pattern, where a label can also be the "*"
+ * wildcard. Each "*" goes through as a plain label and is put back in out.
+ */
+static_always_inline word domain_normalize_pattern(const u8 *domain, uword len, u8 *out, u64 dots[4])
+{
+    u8 name[DOMAIN_MAX + 1];
+    u64 stars[4] = { 0 };
+    word n;
+
+    if (len > DOMAIN_MAX + 1)
+        return -1;
+
+    for (uword i = 0; i < len; i++) {
+        name[i] = domain[i];
+        if (domain[i] != '*')
+            continue;
+        if ((i > 0 && domain[i - 1] != '.') || (i + 1 < len && domain[i + 1] != '.'))
+            return -1;
+        name[i] = 'a';
+        stars[i / 64] |= 1ULL << (i % 64);
+    }
+
+    if ((n = domain_normalize(name, len, out, dots)) < 0)
+        return -1;
+
+    for (int w = 0; w < 4; w++)
+        for (u64 m = stars[w]; m; m &= m - 1)
+            out[w * 64 + count_trailing_zeros(m)] = '*';
+    return n;
+}
+
+#endif
@@ -4,229 +4,2122 @@
 #include "vppinfra/vec.h"
 #include "vppinfra/vec_bootstrap.h"
 #include <vppinfra/bihash_template.c>
+#include <vppinfra/xxhash.h>
+#include <errno.h>
+#include <fcntl.h>
 
-static void insert_domain_labels(domain_trie_t *dt, u8 ** labels);
+static_always_inline u64 edge_key(u32 parent, u32 label)
+{
+    return ((u64)parent << 32) | label;
+}
+
+static void retire(domain_trie_dict_t *d, domain_trie_retire_t what, u32 index, void *p);
+
+/*
+ * pool_get() for a pool readers may be walking: rather than let it realloc
+ * under them, grow a private copy, publish it and retire the old one.
+ */
+#define reader_safe_pool_get(d, P, E, what)                         \
+    do {                                                            \
+        if ((d)->readers && pool_get_will_expand(P)) {              \
+            typeof(P) _grown = pool_dup(P);                         \
+            pool_alloc(_grown, clib_max(pool_len(P), 16));          \
+            if (P)                                                  \
+                retire((d), (what), 0, (P));                        \
+            __atomic_store_n(&(P), _grown, __ATOMIC_RELEASE);       \
+        }                                                           \
+        pool_get(P, E);                                             \
+    } while (0)
+
+static u32 add_node(domain_trie_t *dt)
+{
+    domain_trie_node_t *node = 0;
+
+    reader_safe_pool_get(dt->dict, dt->nodes, node, DOMAIN_TRIE_RETIRE_NODES);
+    node->backendsets = DOMAIN_TRIE_NO_MATCH;
+    node->wildcard_child = DOMAIN_TRIE_INVALID_INDEX;
+    node->counter = 0;
+
+    return node - dt->nodes;
+}
+
+/*
+ * Size a bihash so that n entries fill load_factor of each bucket's first
+ * page. The arena covers every bucket at its first page, plus one page
+ * per BIHASH_KVP_PER_PAGE entries for the buckets that split anyway.
+ */
+static void init_hash_sized(BVT(clib_bihash) *h, char *name, uword n, f64 load_factor)
+{
+    uword nbuckets = clib_max(n / (BIHASH_KVP_PER_PAGE * load_factor), 1);
+    uword page = BIHASH_KVP_PER_PAGE * sizeof(BVT(clib_bihash_kv));
+    uword size = nbuckets * (sizeof(BVT(clib_bihash_bucket)) + page) + n / BIHASH_KVP_PER_PAGE * page;
+
+    BV(clib_bihash_init)(h, name, nbuckets, clib_max(size, 1ULL << 20));
+}
+
+/*
+ * Create a label dictionary for about n_labels distinct labels of
+ * label_bytes bytes in all, or at the fixed TRIE_HASH_BUCKET size for 0.
+ * The caller holds the only reference; each trie created on it with
+ * domain_trie_init_shared() takes one more.
+ */
+domain_trie_dict_t *domain_trie_dict_create(uword n_labels, uword label_bytes, f64 load_factor)
+{
+    domain_trie_dict_t *d = clib_mem_alloc(sizeof(*d));
+
+    clib_memset(d, 0, sizeof(*d));
+    if (n_labels)
+        init_hash_sized(&d->labels, LABEL_HASH_NAME, n_labels,
+                        load_factor > 0 ? load_factor : DOMAIN_TRIE_LOAD_FACTOR);
+    else
+        BV(clib_bihash_init)(&d->labels, LABEL_HASH_NAME, TRIE_HASH_BUCKET, TRIE_HASH_SIZE);
+    pool_alloc(d->pool_labels, n_labels);
+    vec_alloc(d->label_arena[0], label_bytes);
+    d->refcount = 1;
+    d->epoch = 1;
+
+    return d;
+}
+
+/* No reader may be left when the last reference goes */
+void domain_trie_dict_unref(domain_trie_dict_t *d)
+{
+    domain_trie_retired_t *r;
+
+    if (--d->refcount)
+        return;
+
+    vec_foreach(r, d->retired) {
+        if (r->what == DOMAIN_TRIE_RETIRE_NODES || r->what == DOMAIN_TRIE_RETIRE_LABELS)
+            pool_free(r->p);
+        else if (r->what == DOMAIN_TRIE_RETIRE_ARENA || r->what == DOMAIN_TRIE_RETIRE_FILTER)
+            vec_free(r->p);
+    }
+    vec_free(d->retired);
+    if (d->readers)
+        clib_mem_free(d->readers);
+
+    BV(clib_bihash_free)(&(d->labels));
+    pool_free(d->pool_labels);
+    vec_free(d->label_arena[0]);
+    vec_free(d->label_arena[1]);
+    vec_free(d->filter);
+    clib_mem_free(d);
+}
+
+static void init_fields(domain_trie_t *dt, domain_trie_dict_t *d)
+{
+    dt->nodes = NULL;
+    dt->dict = d;
+    clib_memset(dt->wildcards, 0, sizeof(dt->wildcards));
+    dt->generation = 0;
+    dt->journal = NULL;
+}
+
+void domain_trie_init(domain_trie_t *dt)
+{
+    BV(clib_bihash_init)(&(dt->trie), TRIE_HASH_NAME, TRIE_HASH_BUCKET, TRIE_HASH_SIZE);
+    init_fields(dt, domain_trie_dict_create(0, 0, 0));
+    add_node(dt);
+}
+
+/*
+ * Initialize dt with its own dictionary, the bihashes, both pools and the
+ * label arena already large enough for n_nodes nodes besides the root,
+ * n_edges edges, n_labels distinct labels and label_bytes bytes of label
+ * text.
+ */
+static void init_sized(domain_trie_t *dt, uword n_nodes, uword n_edges, uword n_labels, uword label_bytes,
+                       f64 load_factor)
+{
+    init_hash_sized(&dt->trie, TRIE_HASH_NAME, n_edges, load_factor);
+    init_fields(dt, domain_trie_dict_create(n_labels, label_bytes, load_factor));
+    pool_alloc(dt->nodes, n_nodes + 1);
+    add_node(dt);
+}
+
+/*
+ * Initialize dt for about n_patterns patterns of DOMAIN_TRIE_LABELS_PER_PATTERN
+ * labels, with both bihashes sized to load_factor of a page per bucket.
+ */
+void domain_trie_init_capacity(domain_trie_t *dt, uword n_patterns, f64 load_factor)
+{
+    uword n_edges = n_patterns * DOMAIN_TRIE_LABELS_PER_PATTERN;
+
+    if (load_factor <= 0)
+        load_factor = DOMAIN_TRIE_LOAD_FACTOR;
+
+    init_sized(dt, n_edges, n_edges, n_edges, n_edges * LABEL_MAX / 4, load_factor);
+}
+
+/*
+ * Initialize dt on a dictionary other tries may share, sized for about
+ * n_patterns patterns. Labels the tries have in common are stored once, so
+ * the dictionary grows with the distinct labels of all of them, and each
+ * trie only adds its edges and nodes. Threads, filter and reclaiming are
+ * per dictionary: enabling readers or the filter on one trie enables them
+ * on all, and a reader registered through any of them may look up in all.
+ */
+void domain_trie_init_shared(domain_trie_t *dt, domain_trie_dict_t *d, uword n_patterns, f64 load_factor)
+{
+    uword n_edges = n_patterns * DOMAIN_TRIE_LABELS_PER_PATTERN;
+
+    if (load_factor <= 0)
+        load_factor = DOMAIN_TRIE_LOAD_FACTOR;
+
+    init_hash_sized(&dt->trie, TRIE_HASH_NAME, n_edges, load_factor);
+    init_fields(dt, d);
+    d->refcount++;
+    pool_alloc(dt->nodes, n_edges + 1);
+    add_node(dt);
+}
+
+static void del_label_ref(domain_trie_dict_t *d, u32 idx);
+
+static int free_edge_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    u32 **labels = arg;
+
+    vec_add1(*labels, (u32)kv->key);
+    return BIHASH_WALK_CONTINUE;
+}
+
+/*
+ * No reader may be left when the trie itself goes away. Its edges give up
+ * their labels first, so that a shared dictionary only keeps labels other
+ * tries still use.
+ */
+void domain_trie_free(domain_trie_t *dt)
+{
+    domain_trie_dict_t *d = dt->dict;
+    domain_trie_retired_t *r;
+    u32 *labels = 0, *idx;
+
+    domain_trie_journal_close(dt);
+
+    if (d->refcount > 1) {
+        BV(clib_bihash_foreach_key_value_pair)(&dt->trie, free_edge_kv, &labels);
+        vec_foreach(idx, labels)
+            del_label_ref(d, *idx);
+        vec_free(labels);
+
+        /* Deleted nodes can only go back to the pool being freed */
+        u32 n_kept = 0;
+        vec_foreach(r, d->retired) {
+            if (r->what != DOMAIN_TRIE_RETIRE_NODE || r->p != dt)
+                d->retired[n_kept++] = *r;
+        }
+        vec_set_len(d->retired, n_kept);
+    }
+
+    BV(clib_bihash_free)(&(dt->trie));
+    pool_free(dt->nodes);
+    domain_trie_dict_unref(d);
+    dt->dict = NULL;
+}
+
+/*
+ * Let threads other than the writer look up concurrently with inserts and
+ * deletes. Each reader thread registers once and brackets its lookups with
+ * domain_trie_read_lock()/domain_trie_read_unlock().
+ *
+ * The bihashes already take one writer and lock-free readers. Everything
+ * else a reader can reach is never freed or reused in place while it may
+ * still be looking at it: deleted nodes and labels, and pools or arenas
+ * that had to grow, are retired with the current epoch and only released
+ * once no reader has been inside since that epoch.
+ */
+void domain_trie_enable_readers(domain_trie_t *dt)
+{
+    domain_trie_dict_t *d = dt->dict;
+
+    if (d->readers)
+        return;
+
+    d->readers = clib_mem_alloc_aligned(DOMAIN_TRIE_MAX_READERS * sizeof(domain_trie_reader_t),
+                                        CLIB_CACHE_LINE_BYTES);
+    clib_memset(d->readers, 0, DOMAIN_TRIE_MAX_READERS * sizeof(domain_trie_reader_t));
+}
+
+/* Returns a reader index, or ~0 if all DOMAIN_TRIE_MAX_READERS are taken */
+u32 domain_trie_reader_register(domain_trie_t *dt)
+{
+    for (u32 i = 0; i < DOMAIN_TRIE_MAX_READERS; i++) {
+        u32 free = 0;
+        if (__atomic_compare_exchange_n(&dt->dict->readers[i].in_use, &free, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return i;
+    }
+    return ~0U;
+}
+
+void domain_trie_reader_unregister(domain_trie_t *dt, u32 reader)
+{
+    __atomic_store_n(&dt->dict->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&dt->dict->readers[reader].in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void free_retired(domain_trie_dict_t *d, domain_trie_retired_t *r)
+{
+    switch (r->what) {
+    case DOMAIN_TRIE_RETIRE_NODE:
+        pool_put_index(((domain_trie_t *)r->p)->nodes, r->index);
+        break;
+    case DOMAIN_TRIE_RETIRE_LABEL:
+        d->label_arena_garbage += pool_elt_at_index(d->pool_labels, r->index)->len;
+        pool_put_index(d->pool_labels, r->index);
+        break;
+    case DOMAIN_TRIE_RETIRE_NODES:
+    case DOMAIN_TRIE_RETIRE_LABELS:
+        pool_free(r->p);
+        break;
+    case DOMAIN_TRIE_RETIRE_ARENA:
+    case DOMAIN_TRIE_RETIRE_FILTER:
+        vec_free(r->p);
+        break;
+    case DOMAIN_TRIE_RETIRE_SLOT:
+        vec_free(d->label_arena[r->index]);
+        break;
+    }
+}
+
+/* Without readers there is nobody to wait for */
+static void retire(domain_trie_dict_t *d, domain_trie_retire_t what, u32 index, void *p)
+{
+    domain_trie_retired_t r = { .epoch = d->epoch, .what = what, .index = index, .p = p };
+
+    if (d->readers)
+        vec_add1(d->retired, r);
+    else
+        free_retired(d, &r);
+}
+
+static_always_inline int is_wildcard(const u8 *label, uword len)
+{
+    return len == 1 && label[0] == '*';
+}
+
+static_always_inline u32 match_label(domain_trie_dict_t *d, u32 idx, const u8 *label, uword len)
+{
+    while (idx != DOMAIN_TRIE_INVALID_INDEX) {
+        domain_trie_label_t *l = domain_trie_dict_label_at(d, idx);
+        if (l->len == len && !memcmp(domain_trie_dict_label_data(d, l), label, len))
+            return idx;
+        idx = __atomic_load_n(&l->next, __ATOMIC_ACQUIRE);
+    }
+    return ~0U;
+}
+
+static u32 get_label_index(domain_trie_dict_t *d, domain_label_hash_t hash, const u8 *label, uword len)
+{
+    BVT(clib_bihash_kv) kv;
+
+    kv.key = hash;
+
+    int rc = BV(clib_bihash_search)(&(d->labels), &kv, &kv);
+    if (rc == 0)
+        return match_label(d, kv.value, label, len);
+
+    return ~0U;
+}
+
+/* Append to the current arena and return the label offset for the bytes */
+static u32 arena_add(domain_trie_dict_t *d, const u8 *bytes, uword len)
+{
+    u32 slot = d->label_arena_slot;
+    u8 *arena = d->label_arena[slot];
+    u32 offset = vec_len(arena);
+
+    /* Old offsets stay valid in the copy, so readers may use either */
+    if (d->readers && offset + len > vec_max_len(arena)) {
+        u8 *grown = vec_dup(arena);
+        vec_alloc(grown, clib_max(offset, len));
+        if (arena)
+            retire(d, DOMAIN_TRIE_RETIRE_ARENA, 0, arena);
+        __atomic_store_n(&d->label_arena[slot], grown, __ATOMIC_RELEASE);
+        arena = grown;
+    }
+
+    vec_add(arena, bytes, len);
+    d->label_arena[slot] = arena;
+
+    return offset | (slot ? DOMAIN_TRIE_ARENA_SLOT : 0);
+}
+
+static void filter_set(u64 *filter, domain_label_hash_t hash)
+{
+    u64 h = domain_trie_filter_hash(hash);
+    u64 *block = domain_trie_filter_block(filter, h);
+
+    for (u32 i = 0; i < 8; i++)
+        block[i] |= domain_trie_filter_bit(h, i);
+}
+
+static u32 add_label(domain_trie_dict_t *d, domain_label_hash_t hash, const u8 *label, uword len)
+{
+    BVT(clib_bihash_kv) kv;
+    domain_trie_label_t *l = 0;
+
+    reader_safe_pool_get(d, d->pool_labels, l, DOMAIN_TRIE_RETIRE_LABELS);
+    l->offset = arena_add(d, label, len);
+    l->len = len;
+    l->next = DOMAIN_TRIE_INVALID_INDEX;
+    l->counter = 0;
+
+    /* Readers must find the label in the filter as soon as it is in the trie */
+    if (d->filter) {
+        filter_set(d->filter, hash);
+        d->filter_keys++;
+    }
+
+    /* Push in front of the label hash collision chain */
+    kv.key = hash;
+    if (BV(clib_bihash_search)(&(d->labels), &kv, &kv) == 0)
+        l->next = kv.value;
+
+    kv.value = l - d->pool_labels;
+    BV(clib_bihash_add_del)(&(d->labels), &kv, 1);
+
+    return l - d->pool_labels;
+}
+
+/*
+ * Copy the live labels into the other arena slot, dropping deleted ones.
+ * The new arena is published before any label moves to it, and each label
+ * offset names its slot, so a reader always pairs an offset with the arena
+ * it was written for. The old slot is retired and cannot be compacted into
+ * again until it has been freed.
+ */
+static void compact_label_arena(domain_trie_dict_t *d)
+{
+    u32 from = d->label_arena_slot, to = !from;
+    u32 slot_bit = to ? DOMAIN_TRIE_ARENA_SLOT : 0;
+    domain_trie_label_t *l;
+    u8 *arena = 0;
+
+    if (d->label_arena[to])
+        return;
+
+    vec_alloc(arena, vec_len(d->label_arena[from]) - d->label_arena_garbage);
+    pool_foreach(l, d->pool_labels)
+        vec_add(arena, domain_trie_dict_label_data(d, l), l->len);
+    __atomic_store_n(&d->label_arena[to], arena, __ATOMIC_RELEASE);
+
+    u32 offset = 0;
+    pool_foreach(l, d->pool_labels) {
+        __atomic_store_n(&l->offset, offset | slot_bit, __ATOMIC_RELEASE);
+        offset += l->len;
+    }
+
+    d->label_arena_slot = to;
+    d->label_arena_garbage = 0;
+    retire(d, DOMAIN_TRIE_RETIRE_SLOT, from, 0);
+}
+
+/*
+ * Build a filter with room for twice the current labels into a private
+ * vec, then publish it: it already holds every label, so a reader using
+ * either the old or the new one never misses one.
+ */
+static void build_filter(domain_trie_dict_t *d)
+{
+    domain_trie_label_t *l;
+    u64 *old = d->filter;
+    u64 *filter = 0;
+    uword n_labels = pool_elts(d->pool_labels);
+
+    uword n_blocks = 1ULL << max_log2(clib_max(2 * n_labels * DOMAIN_TRIE_FILTER_BITS_PER_KEY / 512, 1));
+    vec_validate_aligned(filter, n_blocks * 8 - 1, CLIB_CACHE_LINE_BYTES);
+
+    pool_foreach(l, d->pool_labels)
+        filter_set(filter, domain_label_hash(domain_trie_dict_label_data(d, l), l->len));
+    __atomic_store_n(&d->filter, filter, __ATOMIC_RELEASE);
+
+    if (old)
+        retire(d, DOMAIN_TRIE_RETIRE_FILTER, 0, old);
+    d->filter_keys = n_labels;
+    d->filter_stale = 0;
+}
+
+/*
+ * Keep a Bloom filter of every label so a lookup can tell up front which of
+ * its labels cannot be in the trie, and skip both hash probes for them. New
+ * labels are added in place; deleted ones cannot be taken out, so
+ * domain_trie_reclaim() rebuilds the filter once a quarter of its capacity
+ * is stale or it has filled up.
+ */
+void domain_trie_enable_filter(domain_trie_t *dt)
+{
+    if (dt->dict->filter == NULL)
+        build_filter(dt->dict);
+}
+
+/*
+ * Rebuild a stale or full label filter and compact the label arena once it
+ * is mostly garbage, then free whatever was retired before the oldest epoch
+ * a reader is still in. Called after every insert and delete; call it from
+ * an idle writer to release memory sooner.
+ */
+void domain_trie_reclaim(domain_trie_t *dt)
+{
+    domain_trie_dict_t *d = dt->dict;
+
+    if (d->filter) {
+        uword capacity = vec_len(d->filter) * 64 / DOMAIN_TRIE_FILTER_BITS_PER_KEY;
+        if (d->filter_keys > capacity || d->filter_stale > capacity / 4)
+            build_filter(d);
+    }
+
+    if (d->label_arena_garbage > vec_len(d->label_arena[d->label_arena_slot]) / 2)
+        compact_label_arena(d);
+
+    if (vec_len(d->retired)) {
+        u64 oldest = __atomic_add_fetch(&d->epoch, 1, __ATOMIC_SEQ_CST);
+        u32 n_done = 0;
+
+        for (u32 i = 0; i < DOMAIN_TRIE_MAX_READERS; i++) {
+            u64 epoch = __atomic_load_n(&d->readers[i].epoch, __ATOMIC_SEQ_CST);
+            if (epoch && epoch < oldest)
+                oldest = epoch;
+        }
+
+        /* Retired in epoch order, so only a prefix can be ready */
+        while (n_done < vec_len(d->retired) && d->retired[n_done].epoch < oldest)
+            free_retired(d, d->retired + n_done++);
+        if (n_done)
+            vec_delete(d->retired, n_done, 0);
+    }
+}
+
+static void del_label_ref(domain_trie_dict_t *d, u32 idx)
+{
+    BVT(clib_bihash_kv) kv;
+    domain_trie_label_t *l = pool_elt_at_index(d->pool_labels, idx);
+
+    ASSERT(l->counter > 0);
+    if (--l->counter)
+        return;
+
+    kv.key = domain_label_hash(domain_trie_dict_label_data(d, l), l->len);
+    int rc = BV(clib_bihash_search)(&(d->labels), &kv, &kv);
+    ASSERT(rc == 0);
+
+    /* Unlink from the label hash collision chain */
+    if (kv.value == idx) {
+        if (l->next == DOMAIN_TRIE_INVALID_INDEX) {
+            BV(clib_bihash_add_del)(&(d->labels), &kv, 0);
+        } else {
+            kv.value = l->next;
+            BV(clib_bihash_add_del)(&(d->labels), &kv, 1);
+        }
+    } else {
+        domain_trie_label_t *prev = pool_elt_at_index(d->pool_labels, kv.value);
+        while (prev->next != idx)
+            prev = pool_elt_at_index(d->pool_labels, prev->next);
+        __atomic_store_n(&prev->next, l->next, __ATOMIC_RELEASE);
+    }
+
+    retire(d, DOMAIN_TRIE_RETIRE_LABEL, idx, 0);
+    d->filter_stale += d->filter != NULL;
+}
+
+static u32 add_child(domain_trie_t *dt, u32 parent, u32 depth, domain_label_hash_t hash, const u8 *label, uword len)
+{
+    BVT(clib_bihash_kv) kv;
+    u32 child;
+
+    if (is_wildcard(label, len)) {
+        child = pool_elt_at_index(dt->nodes, parent)->wildcard_child;
+        if (child == DOMAIN_TRIE_INVALID_INDEX) {
+            child = add_node(dt);
+            __atomic_store_n(&dt->wildcards[depth], dt->wildcards[depth] + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&pool_elt_at_index(dt->nodes, parent)->wildcard_child, child,
+                             __ATOMIC_RELEASE);
+        }
+        return child;
+    }
+
+    u32 idx = get_label_index(dt->dict, hash, label, len);
+    if (idx != ~0U) {
+        kv.key = edge_key(parent, idx);
+        if (BV(clib_bihash_search)(&(dt->trie), &kv, &kv) == 0)
+            return kv.value;
+    } else {
+        idx = add_label(dt->dict, hash, label, len);
+    }
+
+    child = add_node(dt);
+    pool_elt_at_index(dt->dict->pool_labels, idx)->counter += 1;
+
+    kv.key = edge_key(parent, idx);
+    kv.value = child;
+    BV(clib_bihash_add_del)(&(dt->trie), &kv, 1);
+
+    return child;
+}
+
+static int journal_append(domain_trie_t *dt, u8 op, const u8 *domain, const domain_labels_t *labels,
+                          u64 backendsets);
+static void journal_checkpoint_due(domain_trie_t *dt);
+
+/* Insert a pattern already split into labels, at offsets from domain */
+static void insert_labels(domain_trie_t *dt, const u8 *domain, const domain_labels_t *labels, u64 backendsets)
+{
+    u32 path[LABELS_MAX];
+    u32 depth = labels->n_labels;
+    u32 node = DOMAIN_TRIE_ROOT;
+
+    for (u32 i = 0; i < depth; i++) {
+        node = add_child(dt, node, i, labels->hash[i], domain + labels->offset[i], labels->len[i]);
+        path[i] = node;
+    }
+
+    /* Only a new pattern holds a reference on the nodes along its path */
+    if (pool_elt_at_index(dt->nodes, node)->backendsets == DOMAIN_TRIE_NO_MATCH) {
+        for (u32 i = 0; i < depth; i++)
+            pool_elt_at_index(dt->nodes, path[i])->counter += 1;
+    }
+
+    pool_elt_at_index(dt->nodes, node)->backendsets = backendsets;
+    __atomic_store_n(&dt->generation, dt->generation + 1, __ATOMIC_RELEASE);
+    domain_trie_reclaim(dt);
+}
+
+/*
+ * Lowercase and check a pattern the way lookups are, into normalized
+ * (DOMAIN_MAX + 1 bytes), and split it into labels. Returns -1 if
+ * domain_normalize_pattern() rejects it or it is empty.
+ */
+static int split_pattern(const u8 *domain, uword len, u8 *normalized, domain_labels_t *labels)
+{
+    u64 dots[4];
+    word n = domain_normalize_pattern(domain, len, normalized, dots);
+
+    if (n <= 0)
+        return -1;
+    return domain_labels_from_dots(normalized, n, dots, labels);
+}
+
+/*
+ * A checkpoint went in without its journal, see domain_trie_checkpoint(),
+ * or a record could not be written, see journal_append()
+ */
+static_always_inline int journal_broken(domain_trie_t *dt)
+{
+    return dt->journal && dt->journal->fd < 0;
+}
+
+static int insert_len(domain_trie_t *dt, const u8 *domain, uword len, u64 backendsets)
+{
+    u8 normalized[DOMAIN_MAX + 1];
+    domain_labels_t labels;
+
+    /* NO_MATCH marks the nodes no pattern ends on, it can't be a value */
+    if (backendsets == DOMAIN_TRIE_NO_MATCH || journal_broken(dt))
+        return -1;
+
+    if (split_pattern(domain, len, normalized, &labels) <= 0)
+        return -1;
+
+    if (dt->journal && journal_append(dt, DOMAIN_TRIE_JOURNAL_INSERT, normalized, &labels, backendsets) < 0)
+        return -1;
+
+    insert_labels(dt, normalized, &labels, backendsets);
+    if (dt->journal)
+        journal_checkpoint_due(dt);
+    return 0;
+}
+
+int domain_trie_insert(domain_trie_t *dt, const char *domain, u64 backendsets)
+{
+    return insert_len(dt, (const u8 *)domain, strnlen(domain, DOMAIN_MAX + 2), backendsets);
+}
+
+static_always_inline int is_blank(u8 c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Parse one "pattern backendset" line. Returns 1 for a pattern, 0 for a
+ * blank or '#' comment line and -1 if the line is malformed.
+ */
+static int parse_line(const u8 *line, uword len, const u8 **pattern, uword *pattern_len, u64 *backendsets)
+{
+    uword i = 0, start;
+
+    while (i < len && is_blank(line[i]))
+        i++;
+    if (i == len || line[i] == '#')
+        return 0;
+
+    start = i;
+    while (i < len && !is_blank(line[i]))
+        i++;
+    *pattern = line + start;
+    *pattern_len = i - start;
+
+    while (i < len && is_blank(line[i]))
+        i++;
+    if (i == len || line[i] < '0' || line[i] > '9')
+        return -1;
+
+    /* Up to DOMAIN_TRIE_NO_MATCH, which marks the nodes no pattern ends on */
+    *backendsets = 0;
+    while (i < len && line[i] >= '0' && line[i] <= '9') {
+        u64 digit = line[i++] - '0';
+        if (*backendsets > (DOMAIN_TRIE_NO_MATCH - 1 - digit) / 10)
+            return -1;
+        *backendsets = *backendsets * 10 + digit;
+    }
+
+    while (i < len && is_blank(line[i]))
+        i++;
+    return i == len ? 1 : -1;
+}
+
+static u8 *read_file(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    u8 *data = NULL;
+    long size;
+
+    if (file == NULL)
+        return NULL;
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        vec_validate(data, size);
+        if (fread(data, 1, size, file) != (size_t)size)
+            vec_free(data);
+        else
+            vec_set_len(data, size);
+    }
+
+    fclose(file);
+    return data;
+}
+
+/* Open-addressed set of 64-bit hashes, 0 marks a free slot */
+typedef struct {
+    u64 *keys;
+    uword n;
+} key_set_t;
+
+/* Room for up to n_max keys, at most 3/4 full */
+static void key_set_init(key_set_t *set, uword n_max)
+{
+    set->keys = 0;
+    set->n = 0;
+    vec_validate(set->keys, (1ULL << max_log2(n_max + n_max / 3 + 1)) - 1);
+}
+
+static_always_inline void key_set_prefetch(key_set_t *set, u64 key)
+{
+    CLIB_PREFETCH(&set->keys[(key + (key == 0)) & (vec_len(set->keys) - 1)], sizeof(u64), LOAD);
+}
+
+/* Returns 1 if key was not in the set yet */
+static int key_set_add(key_set_t *set, u64 key)
+{
+    uword mask = vec_len(set->keys) - 1, i;
+
+    key += key == 0;
+    for (i = key & mask; set->keys[i]; i = (i + 1) & mask) {
+        if (set->keys[i] == key)
+            return 0;
+    }
+    set->keys[i] = key;
+    set->n++;
+    return 1;
+}
+
+/* A label of a pattern file, for the counts domain_trie_load_file() sizes by */
+typedef struct {
+    u64 suffix; /* hash of the label and all the labels after it */
+    u64 label;  /* hash of the label, 0 for a wildcard */
+    uword len;
+} load_label_t;
+
+/* Labels to hash before the first one is looked up, so the sets can prefetch */
+#define LOAD_LABELS_AHEAD 32
+
+typedef struct {
+    key_set_t labels, suffixes;
+    load_label_t ahead[LOAD_LABELS_AHEAD];
+    u32 head, n_ahead;
+    uword n_nodes, n_edges, label_bytes;
+} load_counts_t;
+
+static void load_count(load_counts_t *c, load_label_t *l)
+{
+    if (!key_set_add(&c->suffixes, l->suffix))
+        return;
+    c->n_nodes++;
+    if (l->label == 0)
+        return;
+    c->n_edges++;
+    if (key_set_add(&c->labels, l->label))
+        c->label_bytes += l->len;
+}
+
+/* Count a label once LOAD_LABELS_AHEAD more are queued behind it */
+static void load_queue(load_counts_t *c, u64 suffix, u64 label, uword len)
+{
+    load_label_t *l = &c->ahead[(c->head + c->n_ahead) % LOAD_LABELS_AHEAD];
+
+    if (c->n_ahead == LOAD_LABELS_AHEAD) {
+        load_count(c, l);
+        c->head = (c->head + 1) % LOAD_LABELS_AHEAD;
+        c->n_ahead--;
+    }
+    key_set_prefetch(&c->suffixes, suffix);
+    if (label)
+        key_set_prefetch(&c->labels, label);
+    l->suffix = suffix;
+    l->label = label;
+    l->len = len;
+    c->n_ahead++;
+}
+
+/*
+ * Initialize dt and load every "pattern backendset" line of path into it.
+ *
+ * A first pass over the file counts the distinct suffixes, which are the
+ * nodes, the ones not ending on a wildcard, which are the edges, and the
+ * distinct labels and their bytes. It keeps a 64-bit hash of each in a
+ * plain hash set, a suffix's chained from its parent's. Every table is
+ * allocated at that size up front, so the inserts never split a bihash
+ * bucket or grow a pool. A hash collision only undercounts, and the
+ * tables grow as usual past their size.
+ *
+ * Returns the number of patterns loaded, or -1 if path cannot be read or
+ * has a malformed line, a backendset of DOMAIN_TRIE_NO_MATCH or more, or a
+ * pattern domain_trie_insert() would reject. dt is left uninitialized then.
+ */
+int domain_trie_load_file(domain_trie_t *dt, const char *path)
+{
+    u8 normalized[DOMAIN_MAX + 1];
+    domain_labels_t split;
+    const u8 *pattern;
+    uword pattern_len;
+    u64 backendsets;
+    load_counts_t c = { 0 };
+    uword n_max = 1;
+    int n_patterns = 0, rc = -1;
+    u8 *data, *line, *end, *eol;
+
+    if ((data = read_file(path)) == NULL)
+        return -1;
+    end = data + vec_len(data);
+
+    /* A label ends on each dot or newline, the sets never have to grow */
+    for (line = data; line < end; line++)
+        n_max += *line == '.' || *line == '\n';
+    key_set_init(&c.labels, n_max);
+    key_set_init(&c.suffixes, n_max);
+
+    for (line = data; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        int n = parse_line(line, eol - line, &pattern, &pattern_len, &backendsets);
+        if (n == 0)
+            continue;
+        if (n < 0 || split_pattern(pattern, pattern_len, normalized, &split) <= 0)
+            goto done;
+
+        u64 suffix = 0;
+        for (u32 i = 0; i < split.n_labels; i++) {
+            const u8 *label = normalized + split.offset[i];
+            u64 key = hash_memory((void *)label, split.len[i], 0);
+
+            suffix = clib_xxhash(suffix ^ key);
+            load_queue(&c, suffix, is_wildcard(label, split.len[i]) ? 0 : key + (key == 0), split.len[i]);
+        }
+    }
+    for (; c.n_ahead; c.n_ahead--, c.head = (c.head + 1) % LOAD_LABELS_AHEAD)
+        load_count(&c, &c.ahead[c.head]);
+
+    init_sized(dt, c.n_nodes, c.n_edges, c.labels.n, c.label_bytes, DOMAIN_TRIE_LOAD_FACTOR);
+
+    for (line = data; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL)
+            eol = end;
+        /* The first pass checked every pattern insert_len() looks at */
+        if (parse_line(line, eol - line, &pattern, &pattern_len, &backendsets) > 0) {
+            insert_len(dt, pattern, pattern_len, backendsets);
+            n_patterns++;
+        }
+    }
+    rc = n_patterns;
+
+done:
+    vec_free(c.labels.keys);
+    vec_free(c.suffixes.keys);
+    vec_free(data);
+    return rc;
+}
+
+/*
+ * Find a pattern already split into labels, at offsets from domain. Fills
+ * path[1..depth] with its nodes and labels[1..depth] with the label index of
+ * each edge, DOMAIN_TRIE_INVALID_INDEX for a wildcard. Returns depth, or -1
+ * if the pattern is not in the trie.
+ */
+static int find_labels(domain_trie_t *dt, const u8 *domain, const domain_labels_t *split, u32 *path,
+                       u32 *labels)
+{
+    BVT(clib_bihash_kv) kv;
+    u32 depth = 0;
+
+    path[0] = DOMAIN_TRIE_ROOT;
+    for (u32 i = 0; i < split->n_labels; i++) {
+        const u8 *label = domain + split->offset[i];
+        uword len = split->len[i];
+        u32 child;
+        u32 idx = DOMAIN_TRIE_INVALID_INDEX;
+
+        if (is_wildcard(label, len)) {
+            child = pool_elt_at_index(dt->nodes, path[depth])->wildcard_child;
+        } else {
+            idx = get_label_index(dt->dict, split->hash[i], label, len);
+            if (idx == ~0U)
+                return -1;
+
+            kv.key = edge_key(path[depth], idx);
+            if (BV(clib_bihash_search)(&(dt->trie), &kv, &kv) < 0)
+                return -1;
+            child = kv.value;
+        }
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            return -1;
+
+        depth++;
+        path[depth] = child;
+        labels[depth] = idx;
+    }
+
+    if (depth == 0 || pool_elt_at_index(dt->nodes, path[depth])->backendsets == DOMAIN_TRIE_NO_MATCH)
+        return -1;
+    return depth;
+}
+
+/* Delete the pattern find_labels() found */
+static void delete_path(domain_trie_t *dt, const u32 *path, const u32 *labels, u32 depth)
+{
+    BVT(clib_bihash_kv) kv;
+    domain_trie_node_t *node = pool_elt_at_index(dt->nodes, path[depth]);
+
+    node->backendsets = DOMAIN_TRIE_NO_MATCH;
+
+    /* Drop the pattern's reference on its path, deepest node first */
+    for (u32 i = depth; i > 0; i--) {
+        node = pool_elt_at_index(dt->nodes, path[i]);
+        if (--node->counter)
+            continue;
+
+        if (labels[i] == DOMAIN_TRIE_INVALID_INDEX) {
+            __atomic_store_n(&pool_elt_at_index(dt->nodes, path[i - 1])->wildcard_child,
+                             DOMAIN_TRIE_INVALID_INDEX, __ATOMIC_RELEASE);
+            __atomic_store_n(&dt->wildcards[i - 1], dt->wildcards[i - 1] - 1, __ATOMIC_RELAXED);
+        } else {
+            kv.key = edge_key(path[i - 1], labels[i]);
+            BV(clib_bihash_add_del)(&(dt->trie), &kv, 0);
+            del_label_ref(dt->dict, labels[i]);
+        }
+
+        retire(dt->dict, DOMAIN_TRIE_RETIRE_NODE, path[i], dt);
+    }
+
+    __atomic_store_n(&dt->generation, dt->generation + 1, __ATOMIC_RELEASE);
+    domain_trie_reclaim(dt);
+}
+
+/* Delete a pattern already split into labels, at offsets from domain */
+static int delete_labels(domain_trie_t *dt, const u8 *domain, const domain_labels_t *split)
+{
+    u32 path[LABELS_MAX + 1];
+    u32 labels[LABELS_MAX + 1];
+    int depth = find_labels(dt, domain, split, path, labels);
+
+    if (depth < 0)
+        return -1;
+    delete_path(dt, path, labels, depth);
+    return 0;
+}
+
+int domain_trie_delete(domain_trie_t *dt, const char *domain)
+{
+    u8 normalized[DOMAIN_MAX + 1];
+    domain_labels_t split;
+    u32 path[LABELS_MAX + 1];
+    u32 labels[LABELS_MAX + 1];
+    int depth;
+
+    if (journal_broken(dt) ||
+        split_pattern((const u8 *)domain, strnlen(domain, DOMAIN_MAX + 2), normalized, &split) <= 0 ||
+        (depth = find_labels(dt, normalized, &split, path, labels)) < 0)
+        return -1;
+
+    if (dt->journal &&
+        journal_append(dt, DOMAIN_TRIE_JOURNAL_DELETE, normalized, &split, DOMAIN_TRIE_NO_MATCH) < 0)
+        return -1;
+
+    delete_path(dt, path, labels, depth);
+    if (dt->journal)
+        journal_checkpoint_due(dt);
+    return 0;
+}
+
+/*
+ * Journal and checkpoint files. A record goes out with one write(2) as
+ * soon as its change is made, so it survives the process dying but not
+ * the machine until the next checkpoint, which is fsync()ed before it
+ * replaces the previous one. Both are in host byte order.
+ */
+static int journal_write(int fd, const void *p, uword len)
+{
+    const u8 *b = p;
+
+    while (len) {
+        ssize_t n = write(fd, b, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        b += n;
+        len -= n;
+    }
+    return 0;
+}
 
-void domain_trie_init(domain_trie_t *dt)
+/* Create an empty journal for epoch at path.tmp, for journal_install() */
+static int journal_prepare(const char *path, u64 epoch)
 {
-    BV(clib_bihash_init)(&(dt->trie), TRIE_HASH_NAME, TRIE_HASH_BUCKET, TRIE_HASH_SIZE);
-    BV(clib_bihash_init)(&(dt->labels), LABEL_HASH_NAME, TRIE_HASH_BUCKET, TRIE_HASH_SIZE);
-    BV(clib_bihash_init)(&(dt->backendsets), BACK_HASH_NAME, TRIE_HASH_BUCKET, TRIE_HASH_SIZE);
-    dt->pool_trie = NULL;
-    dt->pool_backendsets = NULL;
-    dt->pool_labels = NULL;
-    u8 **labels = 0;
-    vec_add1(labels, format(0, "*"));
-    insert_domain_labels(dt, labels);
-    vec_free(labels);
+    domain_trie_journal_header_t h = { DOMAIN_TRIE_JOURNAL_MAGIC, DOMAIN_TRIE_JOURNAL_VERSION, epoch };
+    u8 *tmp = format(0, "%s.tmp%c", path, 0);
+    int fd = open((char *)tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    if (fd >= 0 && (journal_write(fd, &h, sizeof(h)) < 0 || fsync(fd) < 0)) {
+        close(fd);
+        unlink((char *)tmp);
+        fd = -1;
+    }
+
+    vec_free(tmp);
+    return fd;
+}
+
+/* Close and remove the journal from journal_prepare() */
+static void journal_drop(const char *path, int fd)
+{
+    u8 *tmp = format(0, "%s.tmp%c", path, 0);
+
+    close(fd);
+    unlink((char *)tmp);
+    vec_free(tmp);
 }
 
-static u8 **break_domain(char *domain)
+/* Move the journal from journal_prepare() over path, or drop it */
+static int journal_install(const char *path, int fd)
 {
-    u8 **labels = NULL;
-    char *token = NULL;
-    char *save = NULL;
+    u8 *tmp = format(0, "%s.tmp%c", path, 0);
 
-    token = clib_strtok(domain, LABEL_DLM, &save);
-    while (token) {
-        vec_add1(labels, format(0, "%s", token));
-        token = clib_strtok(NULL, LABEL_DLM, &save);
+    if (rename((char *)tmp, path) < 0) {
+        journal_drop(path, fd);
+        fd = -1;
     }
 
-    return labels;
+    vec_free(tmp);
+    return fd;
 }
 
-static u32 *add_value(hash_value_t **pool, update_field_t field, const u8 *label, u64 change)
+/* Create an empty journal for epoch next to path and move it over path */
+static int journal_create(const char *path, u64 epoch)
 {
-    hash_value_t *value = 0;
+    int fd = journal_prepare(path, epoch);
 
-    pool_get(*pool, value);
-    switch (field) {
-        case UPDATE_COUNTER:
-            value->counter = change;
-            break;
-        case UPDATE_BACKENSETS:
-            value->backendsets = change;
-            break;
+    return fd < 0 ? fd : journal_install(path, fd);
+}
+
+/*
+ * Write the record of a change before it is made. A failed write leaves the
+ * journal broken: records behind a torn one would be lost, so the change
+ * and every later one fail until a checkpoint replaces the journal.
+ */
+static int journal_append(domain_trie_t *dt, u8 op, const u8 *domain, const domain_labels_t *labels,
+                          u64 backendsets)
+{
+    domain_trie_journal_t *j = dt->journal;
+    u8 buf[sizeof(domain_trie_journal_record_t) + DOMAIN_MAX + 1];
+    domain_trie_journal_record_t *r = (void *)buf;
+    u8 *p = buf + sizeof(*r);
+
+    for (u32 i = 0; i < labels->n_labels; i++) {
+        *p++ = labels->len[i];
+        clib_memcpy(p, domain + labels->offset[i], labels->len[i]);
+        p += labels->len[i];
     }
 
-    value->data = format(0, "%v", label);
+    r->op = op;
+    r->n_labels = labels->n_labels;
+    r->len = p - buf - sizeof(*r);
+    r->pad = 0;
+    r->backendsets = backendsets;
+    r->crc = clib_crc32c(buf + sizeof(r->crc), p - buf - sizeof(r->crc));
 
-    u32 *tmp = 0;
-    vec_add1(tmp, value - *pool);
+    if (journal_write(j->fd, buf, p - buf) < 0) {
+        close(j->fd);
+        j->fd = -1;
+        return -1;
+    }
 
-    return tmp;
+    j->bytes += p - buf;
+    return 0;
 }
 
-static u32 *update_value(hash_value_t **pool, update_field_t field, u64 value, const u8 *label, u64 change)
+/*
+ * Checkpoint once the journal grows past checkpoint_bytes, after the change
+ * it was written for is made. The change is in once its record is, so a
+ * failed checkpoint only shows in checkpoint_failures, and is tried again
+ * after another checkpoint_bytes.
+ */
+static void journal_checkpoint_due(domain_trie_t *dt)
 {
-    u32 *idxs = (u32 *)value;
-    u32 *idx = 0;
-    int found = 0;
+    domain_trie_journal_t *j = dt->journal;
 
-    vec_foreach(idx, idxs) {
-        if (vec_is_equal((*pool)[*idx].data, label)) {
-            switch (field) {
-                case UPDATE_COUNTER:
-                    (*pool)[*idx].counter += change;
-                    break;
-                case UPDATE_BACKENSETS:
-                    (*pool)[*idx].backendsets = change;
-                    break;
-            }
+    if (j->checkpoint_bytes && j->bytes > j->checkpoint_bytes * (j->checkpoint_failures + 1) &&
+        domain_trie_checkpoint(dt) < 0)
+        j->checkpoint_failures++;
+}
+
+/* Labels of a record, checked since they come from disk */
+static int journal_labels(const u8 *payload, uword len, u32 n_labels, domain_labels_t *labels)
+{
+    uword offset = 0;
+
+    if (n_labels == 0 || n_labels > LABELS_MAX)
+        return -1;
 
-            found = 1;
+    for (u32 i = 0; i < n_labels; i++) {
+        if (offset >= len || payload[offset] == 0 || payload[offset] > LABEL_MAX ||
+            offset + 1 + payload[offset] > len)
+            return -1;
+        labels->offset[i] = offset + 1;
+        labels->len[i] = payload[offset];
+        labels->hash[i] = domain_label_hash(payload + offset + 1, payload[offset]);
+        offset += 1 + payload[offset];
+    }
+
+    labels->n_labels = n_labels;
+    return offset == len ? 0 : -1;
+}
+
+/*
+ * Walk the records of a journal up to the first torn or corrupt one and
+ * return where it starts. With dt, replay them; without, add up the edges
+ * and label bytes they may add, for sizing the tables.
+ */
+static uword journal_scan(domain_trie_t *dt, const u8 *data, uword size, uword *n_edges, uword *label_bytes)
+{
+    uword offset = sizeof(domain_trie_journal_header_t);
+    domain_trie_journal_record_t r;
+    domain_labels_t labels;
+
+    while (offset + sizeof(r) <= size) {
+        const u8 *payload = data + offset + sizeof(r);
+
+        clib_memcpy(&r, data + offset, sizeof(r));
+        if (offset + sizeof(r) + r.len > size ||
+            r.crc != clib_crc32c((u8 *)data + offset + sizeof(r.crc), sizeof(r) - sizeof(r.crc) + r.len) ||
+            (r.op != DOMAIN_TRIE_JOURNAL_INSERT && r.op != DOMAIN_TRIE_JOURNAL_DELETE) ||
+            journal_labels(payload, r.len, r.n_labels, &labels) < 0)
             break;
+
+        if (dt == NULL) {
+            *n_edges += r.n_labels;
+            *label_bytes += r.len;
+        } else if (r.op == DOMAIN_TRIE_JOURNAL_INSERT) {
+            insert_labels(dt, payload, &labels, r.backendsets);
+        } else {
+            delete_labels(dt, payload, &labels);
         }
+        offset += sizeof(r) + r.len;
     }
 
-    if (!found) {
-        hash_value_t *value = 0;
-        pool_get(*pool, value);
-        switch (field) {
-            case UPDATE_COUNTER:
-                value->counter = change;
-                break;
-            case UPDATE_BACKENSETS:
-                value->backendsets = change;
-                break;
+    return offset;
+}
+
+typedef struct {
+    domain_trie_t *dt;
+    u32 *node_map;  /* live node index -> checkpoint node index */
+    u32 *label_map; /* live label index -> checkpoint label index */
+    u32 *labels;    /* live label indexes in the checkpoint's order */
+    u32 n_edges;
+    FILE *file;
+    u32 crc;        /* of everything written so far */
+    int error;
+} checkpoint_args_t;
+
+static void checkpoint_write(checkpoint_args_t *a, const void *p, uword len)
+{
+    a->crc = clib_crc32c_with_init((u8 *)p, len, a->crc);
+    a->error |= fwrite(p, 1, len, a->file) != len;
+}
+
+static int checkpoint_label_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    checkpoint_args_t *a = arg;
+
+    a->label_map[(u32)kv->key] = 0;
+    a->n_edges++;
+    return BIHASH_WALK_CONTINUE;
+}
+
+/* Labels go out in label hash bucket order, so they go back in that order */
+static int checkpoint_order_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    checkpoint_args_t *a = arg;
+    domain_trie_dict_t *d = a->dt->dict;
+
+    for (u32 idx = kv->value; idx != DOMAIN_TRIE_INVALID_INDEX; idx = pool_elt_at_index(d->pool_labels, idx)->next) {
+        if (a->label_map[idx] == 0) {
+            a->label_map[idx] = vec_len(a->labels);
+            vec_add1(a->labels, idx);
         }
+    }
+    return BIHASH_WALK_CONTINUE;
+}
+
+static int checkpoint_edge_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    checkpoint_args_t *a = arg;
+    u32 edge[3] = { a->node_map[kv->key >> 32], a->label_map[(u32)kv->key], a->node_map[kv->value] };
+
+    checkpoint_write(a, edge, sizeof(edge));
+    return BIHASH_WALK_CONTINUE;
+}
+
+/*
+ * Write the whole trie to path.checkpoint under the next epoch, then start
+ * an empty journal for that epoch. The trie goes out as it is laid out in
+ * memory: its labels once each, its nodes renumbered densely and its
+ * edges, labels and edges in the bucket order of their bihashes. A restart
+ * adds them to tables of about the same size, filling buckets mostly front
+ * to back, with no pattern to split or label to look up.
+ *
+ * The new journal is written before the checkpoint replaces the old one, so
+ * only its rename is left after that. A crash between the two renames
+ * leaves the new checkpoint with the old journal, whose epoch tells
+ * domain_trie_journal_open() to skip it. So nothing may be appended to the
+ * old journal once the checkpoint is in: if the new journal cannot be moved
+ * over it, every later insert and delete fails until a checkpoint goes
+ * through again.
+ */
+int domain_trie_checkpoint(domain_trie_t *dt)
+{
+    domain_trie_journal_t *j = dt->journal;
+    domain_trie_dict_t *d = dt->dict;
+    domain_trie_checkpoint_header_t h = { 0 };
+    checkpoint_args_t a = { .dt = dt };
+    domain_trie_node_t *node;
+    u32 *idx;
+    u8 *path, *tmp;
+    int fd, rc = -1;
+
+    if (j == NULL)
+        return -1;
+
+    vec_validate_init_empty(a.node_map, pool_len(dt->nodes), DOMAIN_TRIE_INVALID_INDEX);
+    vec_validate_init_empty(a.label_map, pool_len(d->pool_labels), DOMAIN_TRIE_INVALID_INDEX);
+    pool_foreach(node, dt->nodes)
+        a.node_map[node - dt->nodes] = h.n_nodes++;
+    BV(clib_bihash_foreach_key_value_pair)(&dt->trie, checkpoint_label_kv, &a);
+    BV(clib_bihash_foreach_key_value_pair)(&d->labels, checkpoint_order_kv, &a);
+    vec_foreach(idx, a.labels)
+        h.label_bytes += pool_elt_at_index(d->pool_labels, *idx)->len;
+    h.n_labels = vec_len(a.labels);
+
+    h.magic = DOMAIN_TRIE_CHECKPOINT_MAGIC;
+    h.version = DOMAIN_TRIE_JOURNAL_VERSION;
+    h.epoch = j->epoch + 1;
+    h.n_edges = a.n_edges;
+    clib_memcpy(h.wildcards, dt->wildcards, sizeof(h.wildcards));
 
-        value->data = format(0, "%v", label);
-        vec_add1(idxs, value - *pool);
+    path = format(0, "%s.checkpoint%c", j->path, 0);
+    tmp = format(0, "%s.checkpoint.tmp%c", j->path, 0);
+    if ((a.file = fopen((char *)tmp, "w")) == NULL)
+        goto done;
+
+    checkpoint_write(&a, &h, sizeof(h));
+    vec_foreach(idx, a.labels) {
+        domain_trie_label_t *label = pool_elt_at_index(d->pool_labels, *idx);
+        u8 len = label->len;
+        checkpoint_write(&a, &len, 1);
+        checkpoint_write(&a, domain_trie_label_data(dt, label), len);
+    }
+    pool_foreach(node, dt->nodes) {
+        domain_trie_node_t n = *node;
+        if (n.wildcard_child != DOMAIN_TRIE_INVALID_INDEX)
+            n.wildcard_child = a.node_map[n.wildcard_child];
+        checkpoint_write(&a, &n, sizeof(n));
+    }
+    BV(clib_bihash_foreach_key_value_pair)(&dt->trie, checkpoint_edge_kv, &a);
+    u32 crc = a.crc;
+    checkpoint_write(&a, &crc, sizeof(crc));
+
+    a.error |= fflush(a.file) != 0 || fsync(fileno(a.file)) < 0;
+    a.error |= fclose(a.file) != 0;
+    fd = a.error ? -1 : journal_prepare((char *)j->path, h.epoch);
+    if (fd < 0 || rename((char *)tmp, (char *)path) < 0) {
+        unlink((char *)tmp);
+        if (fd >= 0)
+            journal_drop((char *)j->path, fd);
+        goto done;
     }
 
-    return idxs;
+    /* The old journal is stale from here on */
+    if (j->fd >= 0)
+        close(j->fd);
+    j->epoch = h.epoch;
+    j->fd = journal_install((char *)j->path, fd);
+    if (j->fd < 0)
+        goto done;
+    j->bytes = sizeof(domain_trie_journal_header_t);
+    j->checkpoint_failures = 0;
+    rc = 0;
+
+done:
+    vec_free(a.node_map);
+    vec_free(a.label_map);
+    vec_free(a.labels);
+    vec_free(path);
+    vec_free(tmp);
+    return rc;
+}
+
+/* Check a checkpoint file's header, size and crc32c */
+static int checkpoint_check(const u8 *data, uword size, domain_trie_checkpoint_header_t *h)
+{
+    u32 crc;
+
+    if (size < sizeof(*h) + sizeof(crc))
+        return -1;
+    clib_memcpy(h, data, sizeof(*h));
+    clib_memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+    if (h->magic != DOMAIN_TRIE_CHECKPOINT_MAGIC || h->version != DOMAIN_TRIE_JOURNAL_VERSION)
+        return -1;
+
+    uword expected = sizeof(*h) + h->n_labels + (uword)h->label_bytes + (uword)h->n_nodes * sizeof(domain_trie_node_t) +
+                     (uword)h->n_edges * 3 * sizeof(u32) + sizeof(crc);
+    if (size != expected || h->n_nodes == 0 || crc != clib_crc32c((u8 *)data, size - sizeof(crc)))
+        return -1;
+    return 0;
+}
+
+/* Bring in the buckets and pages a batch of adds will touch, all at once */
+static void prefetch_keys(BVT(clib_bihash) *h, const BVT(clib_bihash_kv) *kv, u32 n)
+{
+    u64 hash[DOMAIN_TRIE_BATCH];
+
+    for (u32 i = 0; i < n; i++) {
+        hash[i] = BV(clib_bihash_hash)((BVT(clib_bihash_kv) *)&kv[i]);
+        BV(clib_bihash_prefetch_bucket)(h, hash[i]);
+    }
+    for (u32 i = 0; i < n; i++)
+        BV(clib_bihash_prefetch_data)(h, hash[i]);
 }
 
-static void insert_domain_labels(domain_trie_t *dt, u8 ** labels)
+/*
+ * Add a checked checkpoint to the freshly initialized dt. The file is read
+ * in order, and labels and edges go into their bihashes a batch at a time
+ * with the batch's misses overlapped.
+ */
+static int checkpoint_load(domain_trie_t *dt, const u8 *data, const domain_trie_checkpoint_header_t *h)
 {
-    BVT(clib_bihash_kv) kv = {0};
+    BVT(clib_bihash_kv) kv[DOMAIN_TRIE_BATCH];
+    const u8 *label[DOMAIN_TRIE_BATCH];
+    domain_trie_dict_t *d = dt->dict;
+    const u8 *p = data + sizeof(*h);
+    u32 *labels = 0;
+    int rc = -1;
 
-    for (int i = 0; i < vec_len(labels); ++i) {
-        kv.key = clib_crc32c(labels[i], vec_len(labels[i]));
+    vec_validate(labels, h->n_labels);
+    for (u32 first = 0; first < h->n_labels; first += DOMAIN_TRIE_BATCH) {
+        u32 n = clib_min(h->n_labels - first, DOMAIN_TRIE_BATCH);
 
-        int rc = BV(clib_bihash_search)(&(dt->labels), &kv, &kv);
-        if (rc < 0) {
-            kv.value = pointer_to_u64(add_value(&dt->pool_labels, UPDATE_COUNTER ,labels[i], 1));
-        }else {
-            kv.value = pointer_to_u64(update_value(&dt->pool_labels, UPDATE_COUNTER,  kv.value, labels[i], 1));
+        for (u32 i = 0; i < n; i++) {
+            label[i] = p;
+            if (*p == 0 || *p > LABEL_MAX)
+                goto done;
+            kv[i].key = domain_label_hash(p + 1, *p);
+            p += 1 + *p;
         }
+        prefetch_keys(&d->labels, kv, n);
+        for (u32 i = 0; i < n; i++)
+            labels[first + i] = add_label(d, kv[i].key, label[i] + 1, label[i][0]);
+    }
+
+    while (pool_len(dt->nodes) < h->n_nodes)
+        add_node(dt);
+    clib_memcpy(dt->nodes, p, h->n_nodes * sizeof(domain_trie_node_t));
+    p += h->n_nodes * sizeof(domain_trie_node_t);
+
+    for (u32 first = 0; first < h->n_edges; first += DOMAIN_TRIE_BATCH) {
+        u32 n = clib_min(h->n_edges - first, DOMAIN_TRIE_BATCH);
+
+        for (u32 i = 0; i < n; i++, p += sizeof(u32) * 3) {
+            u32 edge[3];
+            clib_memcpy(edge, p, sizeof(edge));
+            if (edge[0] >= h->n_nodes || edge[1] >= h->n_labels || edge[2] >= h->n_nodes)
+                goto done;
+            kv[i].key = edge_key(edge[0], labels[edge[1]]);
+            kv[i].value = edge[2];
+            clib_prefetch_store(pool_elt_at_index(d->pool_labels, labels[edge[1]]));
+        }
+        prefetch_keys(&dt->trie, kv, n);
+        for (u32 i = 0; i < n; i++) {
+            BV(clib_bihash_add_del)(&(dt->trie), &kv[i], 1);
+            pool_elt_at_index(d->pool_labels, (u32)kv[i].key)->counter += 1;
+        }
+    }
+
+    clib_memcpy(dt->wildcards, h->wildcards, sizeof(dt->wildcards));
+    rc = 0;
 
-        BV(clib_bihash_add_del)(&(dt->labels), &kv, 1);
+done:
+    vec_free(labels);
+    return rc;
+}
+
+/*
+ * Initialize dt from the checkpoint and journal at path, then log every
+ * insert and delete to the journal, checkpointing once it grows past
+ * checkpoint_bytes (0 for only on domain_trie_checkpoint()). Either file
+ * may be missing; with neither, dt starts empty.
+ *
+ * Every table is sized up front for the checkpoint plus what the journal
+ * may add, the checkpoint goes in without splitting a pattern or looking
+ * up a label, and the journal records carry their labels already split. A
+ * torn record at the end of the journal, from a crash in the middle of a
+ * write, and everything behind it is dropped. Returns 0, or -1 if a file
+ * is corrupt or cannot be opened, in which case dt is left uninitialized.
+ */
+int domain_trie_journal_open(domain_trie_t *dt, const char *path, u64 checkpoint_bytes)
+{
+    domain_trie_checkpoint_header_t h = { 0 };
+    domain_trie_journal_header_t jh;
+    u8 *ckpt_path = format(0, "%s.checkpoint%c", path, 0);
+    u8 *ckpt = read_file((char *)ckpt_path);
+    u8 *journal = read_file(path);
+    uword end = 0, n_edges = 0, label_bytes = 0;
+    int fd, rc = -1;
+
+    if (ckpt && checkpoint_check(ckpt, vec_len(ckpt), &h) < 0)
+        goto done;
+
+    /* A journal older than the checkpoint is already in it */
+    if (vec_len(journal) >= sizeof(jh)) {
+        clib_memcpy(&jh, journal, sizeof(jh));
+        if (jh.magic != DOMAIN_TRIE_JOURNAL_MAGIC || jh.version != DOMAIN_TRIE_JOURNAL_VERSION ||
+            jh.epoch > h.epoch)
+            goto done;
+        if (jh.epoch == h.epoch)
+            end = journal_scan(NULL, journal, vec_len(journal), &n_edges, &label_bytes);
+    }
+
+    if (h.n_edges + n_edges == 0)
+        domain_trie_init(dt);
+    else
+        init_sized(dt, h.n_nodes + n_edges, h.n_edges + n_edges, h.n_labels + n_edges,
+                   h.label_bytes + label_bytes, DOMAIN_TRIE_LOAD_FACTOR);
+
+    if ((ckpt && checkpoint_load(dt, ckpt, &h) < 0) ||
+        (end && journal_scan(dt, journal, end, NULL, NULL) != end)) {
+        domain_trie_free(dt);
+        goto done;
+    }
+
+    if (end)
+        fd = open(path, O_WRONLY | O_APPEND);
+    else
+        fd = journal_create(path, h.epoch);
+    if (fd < 0 || (end && ftruncate(fd, end) < 0)) {
+        if (fd >= 0)
+            close(fd);
+        domain_trie_free(dt);
+        goto done;
     }
+
+    dt->journal = clib_mem_alloc(sizeof(*dt->journal));
+    dt->journal->fd = fd;
+    dt->journal->path = format(0, "%s%c", path, 0);
+    dt->journal->epoch = h.epoch;
+    dt->journal->bytes = end ? end : sizeof(jh);
+    dt->journal->checkpoint_bytes = checkpoint_bytes;
+    dt->journal->checkpoint_failures = 0;
+    rc = 0;
+
+done:
+    vec_free(ckpt_path);
+    vec_free(ckpt);
+    vec_free(journal);
+    return rc;
+}
+
+/* Stop journaling, the files stay for the next domain_trie_journal_open() */
+void domain_trie_journal_close(domain_trie_t *dt)
+{
+    domain_trie_journal_t *j = dt->journal;
+
+    if (j == NULL)
+        return;
+
+    if (j->fd >= 0)
+        close(j->fd);
+    vec_free(j->path);
+    clib_mem_free(j);
+    dt->journal = NULL;
 }
 
-static u32 get_label_index(domain_trie_t *dt, const u8 *label)
+u64 domain_trie_search_len(domain_trie_t *dt, const u8 *domain, uword len)
 {
     BVT(clib_bihash_kv) kv;
-    u32 ret = ~0U;
-
-    kv.key = clib_crc32c(label, vec_len(label));
-
-    int rc = BV(clib_bihash_search)(&(dt->labels), &kv, &kv);
-    if (rc == 0) {
-        u32 *idxs =(u32 *)kv.value;
-        u32 *idx = 0;
-        vec_foreach(idx, idxs) {
-            hash_value_t *v = pool_elt_at_index(dt->pool_labels, *idx);
-            if (vec_is_equal(v->data, label)) {
-                ret = *idx;
-            }
+    domain_labels_t labels;
+    u8 normalized[DOMAIN_MAX + 1];
+    u64 dots[4], known[2];
+    u32 node = DOMAIN_TRIE_ROOT;
+
+    word n = domain_normalize(domain, len, normalized, dots);
+    if (n < 0 || domain_labels_from_dots(normalized, n, dots, &labels) < 0)
+        return DOMAIN_TRIE_NO_MATCH;
+    domain = normalized;
+    if (!domain_trie_filter_labels(dt, &labels, known))
+        return DOMAIN_TRIE_NO_MATCH;
+
+    for (u32 i = 0; i < labels.n_labels; i++) {
+        u32 idx = ~0U;
+        u32 child = DOMAIN_TRIE_INVALID_INDEX;
+
+        if (known[i / 64] & (1ULL << (i % 64)))
+            idx = get_label_index(dt->dict, labels.hash[i], domain + labels.offset[i], labels.len[i]);
+
+        if (idx != ~0U) {
+            kv.key = edge_key(node, idx);
+            if (BV(clib_bihash_search)(&(dt->trie), &kv, &kv) == 0)
+                child = kv.value;
         }
+
+        /* Exact label first, then the wildcard child, no second probe */
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            child = domain_trie_node_at(dt, node)->wildcard_child;
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            return DOMAIN_TRIE_NO_MATCH;
+
+        node = child;
     }
-    return ret;
+
+    return domain_trie_node_at(dt, node)->backendsets;
 }
 
-int domain_trie_insert(domain_trie_t *dt, const char *domain, u64 backendsets)
+/*
+ * One domain in two phases. First every label id is resolved, with the
+ * label hash probes of all levels in flight together and their chain heads
+ * prefetched the same way. Then the trie levels are probed back
+ * to back. The edge key holds the parent node, which only the level above
+ * yields, so the trie probes still wait on each other, but no label probe
+ * sits between them any more.
+ */
+u64 domain_trie_search_pipelined(domain_trie_t *dt, const u8 *domain, uword len)
 {
-    char *copy = strndup(domain, DOMAIN_MAX);
-    int rc = 0;
-    u8 **labels = break_domain(copy);
-    insert_domain_labels(dt, labels);
+    BVT(clib_bihash_kv) kv[LABELS_MAX];
+    u64 hash[LABELS_MAX];
+    u32 ids[LABELS_MAX];
+    domain_labels_t labels;
+    u8 normalized[DOMAIN_MAX + 1];
+    u64 dots[4], known[2];
+    domain_trie_dict_t *d = dt->dict;
+    u32 node = DOMAIN_TRIE_ROOT;
 
-    BVT(clib_bihash_kv) kv = {0};
-    u8 *suffix = 0;
+    word n = domain_normalize(domain, len, normalized, dots);
+    if (n < 0 || domain_labels_from_dots(normalized, n, dots, &labels) < 0)
+        return DOMAIN_TRIE_NO_MATCH;
+    domain = normalized;
+    if (!domain_trie_filter_labels(dt, &labels, known))
+        return DOMAIN_TRIE_NO_MATCH;
 
-    for (int i = vec_len(labels) - 1; i >= 0; i--) {
-        u32 idx = get_label_index(dt, labels[i]);
+    /* Phase one: label hash buckets, then their pages, then the chain heads */
+    for (u32 i = 0; i < labels.n_labels; i++) {
+        ids[i] = ~0U;
+        if (!(known[i / 64] & (1ULL << (i % 64))))
+            continue;
+        ids[i] = 0;
+        kv[i].key = labels.hash[i];
+        hash[i] = BV(clib_bihash_hash)(&kv[i]);
+        BV(clib_bihash_prefetch_bucket)(&d->labels, hash[i]);
+    }
 
-        suffix = format(suffix, "%llu.", idx);
-        kv.key = clib_crc32c(suffix, vec_len(suffix));
+    for (u32 i = 0; i < labels.n_labels; i++)
+        if (ids[i] != ~0U)
+            BV(clib_bihash_prefetch_data)(&d->labels, hash[i]);
 
-        rc =  BV(clib_bihash_search)(&(dt->trie), &kv, &kv);
-        if (rc < 0) {
-            kv.value = pointer_to_u64(add_value(&dt->pool_trie, UPDATE_COUNTER, suffix, 1));
-        } else {
-            kv.value = pointer_to_u64(update_value(&dt->pool_trie, UPDATE_COUNTER, kv.value, suffix, 1));
+    for (u32 i = 0; i < labels.n_labels; i++) {
+        if (ids[i] == ~0U)
+            continue;
+        if (BV(clib_bihash_search_inline_2_with_hash)(&d->labels, hash[i], &kv[i], &kv[i]) < 0) {
+            ids[i] = ~0U;
+            continue;
         }
-
-        BV(clib_bihash_add_del)(&(dt->trie), &kv, 1);
+        ids[i] = kv[i].value;
+        clib_prefetch_load(domain_trie_dict_label_at(d, ids[i]));
     }
 
-    rc =  BV(clib_bihash_search)(&(dt->backendsets), &kv, &kv);
-    if (rc < 0) {
-        kv.value = pointer_to_u64(add_value(&dt->pool_backendsets,UPDATE_BACKENSETS, suffix, backendsets));
-    } else {
-        kv.value = pointer_to_u64(update_value(&dt->pool_backendsets, UPDATE_BACKENSETS, kv.value, suffix, backendsets));
+    for (u32 i = 0; i < labels.n_labels; i++)
+        if (ids[i] != ~0U)
+            ids[i] = match_label(d, ids[i], domain + labels.offset[i], labels.len[i]);
+
+    /* Phase two: one trie probe per level, nothing else on the chain */
+    for (u32 i = 0; i < labels.n_labels; i++) {
+        u32 child = DOMAIN_TRIE_INVALID_INDEX;
+
+        if (ids[i] != ~0U) {
+            kv[i].key = edge_key(node, ids[i]);
+            if (BV(clib_bihash_search)(&(dt->trie), &kv[i], &kv[i]) == 0)
+                child = kv[i].value;
+        }
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            child = domain_trie_node_at(dt, node)->wildcard_child;
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            return DOMAIN_TRIE_NO_MATCH;
+
+        node = child;
     }
-    BV(clib_bihash_add_del)(&(dt->backendsets), &kv, 1);
 
-    free(copy);
-    vec_free(labels);
-    return 0;
+    return domain_trie_node_at(dt, node)->backendsets;
 }
 
-
 u64 domain_trie_search(domain_trie_t *dt, const char *domain)
 {
-    char *copy = strndup(domain, DOMAIN_MAX);
-    u8 **labels = break_domain(copy);
+    return domain_trie_search_len(dt, (const u8 *)domain, strnlen(domain, DOMAIN_MAX + 2));
+}
+
+/*
+ * domain_trie_search() through the calling thread's cache. The generation
+ * is read before the lookup and only bumped after a change is complete, so
+ * a result is never cached under a generation older than the trie it came
+ * from.
+ */
+u64 domain_trie_search_cached(domain_trie_t *dt, domain_cache_t *cache, const char *domain)
+{
+    uword len = strnlen(domain, DOMAIN_MAX + 2);
+    u64 generation = __atomic_load_n(&dt->generation, __ATOMIC_ACQUIRE);
+    u64 key = domain_cache_key(cache, (const u8 *)domain, len, generation);
+    u64 backendsets;
+
+    if (domain_cache_get(cache, key, &backendsets))
+        return backendsets;
+
+    u64 start = clib_cpu_time_now();
+    backendsets = domain_trie_search_len(dt, (const u8 *)domain, len);
+    domain_cache_put(cache, key, backendsets, start);
+    return backendsets;
+}
+
+typedef struct {
+    const u8 *domain;
+    u8 normalized[DOMAIN_MAX + 1];
+    domain_labels_t labels;
+    u32 level;
+    u64 hash;
+    BVT(clib_bihash_kv) kv;
+    u32 node;
+    u32 label;
+    u64 known[2]; /* see domain_trie_filter_labels() */
+} domain_trie_lookup_t;
+
+/*
+ * Up to DOMAIN_TRIE_BATCH lookups advance one label at a time in lockstep.
+ * Each pass over the active lookups issues the prefetches the next pass
+ * needs, so the bucket and page misses of different domains overlap
+ * instead of stalling one after the other.
+ */
+void domain_trie_search_batch(domain_trie_t *dt, const u8 **domains, const uword *lens, u32 n, u64 *results)
+{
+    domain_trie_lookup_t lookups[DOMAIN_TRIE_BATCH];
+    u32 active[DOMAIN_TRIE_BATCH];
+    domain_trie_lookup_t *l;
+
+    for (u32 base = 0; base < n; base += DOMAIN_TRIE_BATCH) {
+        u32 n_batch = clib_min(n - base, DOMAIN_TRIE_BATCH);
+        u32 n_active = 0;
+        u32 n_left;
 
-    BVT(clib_bihash_kv) kv = {0};
-    u64 best_match_key = ~0ULL;
-    u64 best_match = ~0ULL;
-    u8 *suffix = NULL;
+        for (u32 i = 0; i < n_batch; i++) {
+            u64 dots[4];
 
-    for (int i = vec_len(labels) - 1; i >= 0; i--) {
-        u32 idx = get_label_index(dt, labels[i]);
+            l = lookups + i;
+            l->domain = l->normalized;
+            l->level = 0;
+            l->node = DOMAIN_TRIE_ROOT;
 
-        u32 old_len = vec_len(suffix);
-        suffix = format(suffix, "%llu.", idx);
-        kv.key = clib_crc32c(suffix, vec_len(suffix));
+            word len = domain_normalize(domains[base + i], lens[base + i], l->normalized, dots);
+            if (len < 0 || domain_labels_from_dots(l->normalized, len, dots, &l->labels) < 0 ||
+                !domain_trie_filter_labels(dt, &l->labels, l->known)) {
+                results[base + i] = DOMAIN_TRIE_NO_MATCH;
+                continue;
+            }
+            active[n_active++] = i;
+        }
 
-        int rc = BV(clib_bihash_search)(&(dt->trie), &kv, &kv );
-        if (rc < 0) {
-            vec_set_len(suffix, old_len);
-            suffix = format(suffix, "%llu.", 0);
-            kv.key = clib_crc32c(suffix, vec_len(suffix));
+        while (n_active) {
+            /* Next label, prefetch its label hash bucket */
+            n_left = 0;
+            for (u32 i = 0; i < n_active; i++) {
+                l = lookups + active[i];
+                if (l->level == l->labels.n_labels) {
+                    results[base + active[i]] = domain_trie_node_at(dt, l->node)->backendsets;
+                    continue;
+                }
+                active[n_left++] = active[i];
 
-            int rc = BV(clib_bihash_search)(&(dt->trie), &kv, &kv );
-            if (rc < 0) {
-                break;
-            } else {
-                best_match_key = kv.key;
+                /* Not a label of the trie, go for the wildcard */
+                l->label = 0;
+                if (!(l->known[l->level / 64] & (1ULL << (l->level % 64)))) {
+                    l->label = ~0U;
+                    continue;
+                }
+
+                l->kv.key = l->labels.hash[l->level];
+                l->hash = BV(clib_bihash_hash)(&l->kv);
+                BV(clib_bihash_prefetch_bucket)(&dt->dict->labels, l->hash);
             }
-        } else {
-            best_match_key = kv.key;
+            n_active = n_left;
+
+            for (u32 i = 0; i < n_active; i++) {
+                l = lookups + active[i];
+                if (l->label != ~0U)
+                    BV(clib_bihash_prefetch_data)(&dt->dict->labels, l->hash);
+            }
+
+            /* Resolve the label, prefetch the trie bucket of the edge */
+            for (u32 i = 0; i < n_active; i++) {
+                l = lookups + active[i];
+                if (l->label == ~0U)
+                    continue;
+                if (BV(clib_bihash_search_inline_2_with_hash)(&dt->dict->labels, l->hash, &l->kv, &l->kv) == 0)
+                    l->label = match_label(dt->dict, l->kv.value, l->domain + l->labels.offset[l->level],
+                                           l->labels.len[l->level]);
+                else
+                    l->label = ~0U;
+                if (l->label == ~0U)
+                    continue;
+
+                l->kv.key = edge_key(l->node, l->label);
+                l->hash = BV(clib_bihash_hash)(&l->kv);
+                BV(clib_bihash_prefetch_bucket)(&dt->trie, l->hash);
+            }
+
+            for (u32 i = 0; i < n_active; i++) {
+                l = lookups + active[i];
+                if (l->label != ~0U)
+                    BV(clib_bihash_prefetch_data)(&dt->trie, l->hash);
+            }
+
+            /* Take the edge or the wildcard child, prefetch the child node */
+            n_left = 0;
+            for (u32 i = 0; i < n_active; i++) {
+                u32 child = DOMAIN_TRIE_INVALID_INDEX;
+
+                l = lookups + active[i];
+                if (l->label != ~0U &&
+                    BV(clib_bihash_search_inline_2_with_hash)(&dt->trie, l->hash, &l->kv, &l->kv) == 0)
+                    child = l->kv.value;
+
+                if (child == DOMAIN_TRIE_INVALID_INDEX)
+                    child = domain_trie_node_at(dt, l->node)->wildcard_child;
+
+                if (child == DOMAIN_TRIE_INVALID_INDEX) {
+                    results[base + active[i]] = DOMAIN_TRIE_NO_MATCH;
+                    continue;
+                }
+
+                l->node = child;
+                l->level++;
+                clib_prefetch_load(domain_trie_node_at(dt, child));
+                active[n_left++] = active[i];
+            }
+            n_active = n_left;
         }
     }
+}
 
-    kv.key = best_match_key;
-    int rc = BV(clib_bihash_search)(&(dt->backendsets), &kv, &kv );
-    if (rc == 0) {
-        u32 *idxs = (u32 *)kv.value;
-        u32 *idx = 0;
-        vec_foreach(idx, idxs) {
-            hash_value_t *tmp = pool_elt_at_index(dt->pool_backendsets, *idx);
-            if (vec_is_equal(tmp->data, suffix)){
-                best_match = tmp->backendsets;
-            }
+static_always_inline u32 frozen_slot(u32 parent, u32 hash, u32 log2_edges)
+{
+    return ((((u64)parent << 32) | hash) * 0x9e3779b97f4a7c15ULL) >> (64 - log2_edges);
+}
+
+static_always_inline u32 frozen_child(const domain_trie_frozen_t *ft, u32 parent, u32 hash,
+                                      const u8 *label, uword len)
+{
+    const domain_trie_frozen_edge_t *edges = (const void *)((const u8 *)ft + ft->edges);
+    const u8 *text = (const u8 *)ft + ft->text;
+    u32 mask = (1 << ft->log2_edges) - 1;
+
+    for (u32 i = frozen_slot(parent, hash, ft->log2_edges);; i = (i + 1) & mask) {
+        const domain_trie_frozen_edge_t *e = edges + i;
+        if (e->child == DOMAIN_TRIE_INVALID_INDEX)
+            return DOMAIN_TRIE_INVALID_INDEX;
+        if (e->hash == hash && e->parent == parent && text[e->label] == len &&
+            !memcmp(text + e->label + 1, label, len))
+            return e->child;
+    }
+}
+
+typedef struct {
+    domain_trie_t *dt;
+    domain_trie_frozen_t *ft;
+    u32 *node_map;  /* live node index -> frozen node index */
+    u32 *label_map; /* live label index -> frozen text offset */
+    u32 n_edges;
+} freeze_args_t;
+
+/* Only the labels of dt's own edges, the dictionary may hold other tries' */
+static int freeze_label_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    freeze_args_t *a = arg;
+
+    a->label_map[(u32)kv->key] = 0;
+    a->n_edges++;
+    return BIHASH_WALK_CONTINUE;
+}
+
+static int freeze_edge_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    freeze_args_t *a = arg;
+    domain_trie_frozen_t *ft = a->ft;
+    domain_trie_frozen_edge_t *edges = (void *)((u8 *)ft + ft->edges);
+    u8 *text = (u8 *)ft + ft->text;
+    u32 mask = (1 << ft->log2_edges) - 1;
+    u32 label = a->label_map[kv->key & 0xffffffff];
+    u32 parent = a->node_map[kv->key >> 32];
+    u32 hash = domain_label_hash(text + label + 1, text[label]);
+    u32 i = frozen_slot(parent, hash, ft->log2_edges);
+
+    while (edges[i].child != DOMAIN_TRIE_INVALID_INDEX)
+        i = (i + 1) & mask;
+
+    edges[i].parent = parent;
+    edges[i].hash = hash;
+    edges[i].child = a->node_map[kv->value];
+    edges[i].label = label;
+    return BIHASH_WALK_CONTINUE;
+}
+
+/*
+ * Compile dt into a read-only image for domain_trie_search_frozen(). Nodes
+ * are renumbered densely, every (parent, label) edge goes into one
+ * open-addressed table at most 3/4 full keyed by the label's hash, and the
+ * label text is stored once per distinct label right behind its length. A
+ * level then costs one edge probe plus the label compare, instead of two
+ * bihash lookups and a walk through the label pool. dt is left untouched;
+ * free the image with domain_trie_frozen_free().
+ */
+domain_trie_frozen_t *domain_trie_freeze(domain_trie_t *dt)
+{
+    domain_trie_node_t *node;
+    domain_trie_label_t *label;
+    domain_trie_frozen_t *ft;
+    freeze_args_t args = { .dt = dt };
+    domain_trie_dict_t *d = dt->dict;
+    u32 n_nodes = 0, n_edges, text_len = 0;
+    u32 log2_edges;
+
+    vec_validate_init_empty(args.node_map, pool_len(dt->nodes), DOMAIN_TRIE_INVALID_INDEX);
+    vec_validate_init_empty(args.label_map, pool_len(d->pool_labels), DOMAIN_TRIE_INVALID_INDEX);
+
+    pool_foreach(node, dt->nodes)
+        args.node_map[node - dt->nodes] = n_nodes++;
+    BV(clib_bihash_foreach_key_value_pair)(&dt->trie, freeze_label_kv, &args);
+    pool_foreach(label, d->pool_labels) {
+        if (args.label_map[label - d->pool_labels] == 0)
+            text_len += 1 + label->len;
+    }
+    n_edges = args.n_edges;
+    log2_edges = clib_max(max_log2(n_edges + n_edges / 3 + 1), 1);
+
+    uword edges = round_pow2(sizeof(*ft), CLIB_CACHE_LINE_BYTES);
+    uword wildcard_child = edges + round_pow2(sizeof(domain_trie_frozen_edge_t) << log2_edges, CLIB_CACHE_LINE_BYTES);
+    uword backendsets = wildcard_child + round_pow2(n_nodes * sizeof(u32), CLIB_CACHE_LINE_BYTES);
+    uword text = backendsets + round_pow2(n_nodes * sizeof(u64), CLIB_CACHE_LINE_BYTES);
+    uword size = text + round_pow2(text_len, CLIB_CACHE_LINE_BYTES);
+
+    ft = clib_mem_alloc_aligned(size, CLIB_CACHE_LINE_BYTES);
+    clib_memset(ft, 0, text);
+    ft->n_nodes = n_nodes;
+    ft->log2_edges = log2_edges;
+    ft->edges = edges;
+    ft->wildcard_child = wildcard_child;
+    ft->backendsets = backendsets;
+    ft->text = text;
+    ft->size = size;
+    args.ft = ft;
+
+    u8 *t = (u8 *)ft + text;
+    text_len = 0;
+    pool_foreach(label, d->pool_labels) {
+        if (args.label_map[label - d->pool_labels] != 0)
+            continue;
+        args.label_map[label - d->pool_labels] = text_len;
+        t[text_len] = label->len;
+        clib_memcpy(t + text_len + 1, domain_trie_label_data(dt, label), label->len);
+        text_len += 1 + label->len;
+    }
+
+    u32 *wildcard = (void *)((u8 *)ft + wildcard_child);
+    u64 *bs = (void *)((u8 *)ft + backendsets);
+    pool_foreach(node, dt->nodes) {
+        u32 i = args.node_map[node - dt->nodes];
+        wildcard[i] = node->wildcard_child == DOMAIN_TRIE_INVALID_INDEX ?
+            DOMAIN_TRIE_INVALID_INDEX : args.node_map[node->wildcard_child];
+        bs[i] = node->backendsets;
+    }
+
+    domain_trie_frozen_edge_t *e = (void *)((u8 *)ft + edges);
+    for (uword i = 0; i < (1ULL << log2_edges); i++)
+        e[i].child = DOMAIN_TRIE_INVALID_INDEX;
+    BV(clib_bihash_foreach_key_value_pair)(&dt->trie, freeze_edge_kv, &args);
+
+    vec_free(args.node_map);
+    vec_free(args.label_map);
+    return ft;
+}
+
+void domain_trie_frozen_free(domain_trie_frozen_t *ft)
+{
+    clib_mem_free(ft);
+}
+
+u64 domain_trie_search_frozen(const domain_trie_frozen_t *ft, const u8 *domain, uword len)
+{
+    const u32 *wildcard = (const void *)((const u8 *)ft + ft->wildcard_child);
+    const u64 *backendsets = (const void *)((const u8 *)ft + ft->backendsets);
+    domain_labels_t labels;
+    u8 normalized[DOMAIN_MAX + 1];
+    u64 dots[4];
+    u32 node = DOMAIN_TRIE_ROOT;
+
+    word n = domain_normalize(domain, len, normalized, dots);
+    if (n < 0 || domain_labels_from_dots(normalized, n, dots, &labels) < 0)
+        return DOMAIN_TRIE_NO_MATCH;
+
+    for (u32 i = 0; i < labels.n_labels; i++) {
+        u32 child = frozen_child(ft, node, (u32)labels.hash[i], normalized + labels.offset[i], labels.len[i]);
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            child = wildcard[node];
+
+        if (child == DOMAIN_TRIE_INVALID_INDEX)
+            return DOMAIN_TRIE_NO_MATCH;
+
+        node = child;
+    }
+
+    return backendsets[node];
+}
+
+static void bihash_stats(BVT(clib_bihash) *h, domain_trie_bihash_stats_t *stats)
+{
+    clib_memset(stats, 0, sizeof(*stats));
+    stats->nbuckets = h->nbuckets;
+
+    if (!h->instantiated) {
+        stats->occupancy[0] = h->nbuckets;
+        return;
+    }
+
+    for (uword i = 0; i < h->nbuckets; i++) {
+        BVT(clib_bihash_bucket) *b = h->buckets + i;
+        uword n = 0;
+
+        if (BV(clib_bihash_bucket_is_empty)(b)) {
+            stats->occupancy[0]++;
+            continue;
         }
+
+        BVT(clib_bihash_value) *v = BV(clib_bihash_get_value)(h, b->offset);
+        for (uword j = 0; j < (BIHASH_KVP_PER_PAGE << b->log2_pages); j++)
+            n += !BV(clib_bihash_is_free)(&v->kvp[0] + j);
+
+        stats->entries += n;
+        stats->linear_buckets += b->linear_search;
+        stats->occupancy[clib_min(n, DOMAIN_TRIE_STATS_HIST - 1)]++;
+        stats->log2_pages[clib_min((u32)b->log2_pages, DOMAIN_TRIE_STATS_HIST - 1)]++;
     }
 
-    free(copy);
-    vec_free(labels);
-    vec_free(suffix);
-    return best_match;
+    stats->load = (f64)stats->entries / (h->nbuckets * BIHASH_KVP_PER_PAGE);
+}
+
+typedef struct {
+    domain_trie_t *dt;
+    domain_trie_hash_stats_t *stats;
+} chain_stats_args_t;
+
+static int chain_stats_kv(BVT(clib_bihash_kv) *kv, void *arg)
+{
+    chain_stats_args_t *a = arg;
+    uword n = 0;
+
+    for (u32 idx = kv->value; idx != DOMAIN_TRIE_INVALID_INDEX; n++)
+        idx = pool_elt_at_index(a->dt->dict->pool_labels, idx)->next;
+
+    a->stats->chains[clib_min(n, DOMAIN_TRIE_STATS_HIST) - 1]++;
+    return BIHASH_WALK_CONTINUE;
+}
+
+/* Walk both bihashes and every label chain; meant for the CLI, not the data path */
+void domain_trie_hash_stats(domain_trie_t *dt, domain_trie_hash_stats_t *stats)
+{
+    chain_stats_args_t args = { dt, stats };
+
+    bihash_stats(&dt->trie, &stats->trie);
+    bihash_stats(&dt->dict->labels, &stats->labels);
+    clib_memset(stats->chains, 0, sizeof(stats->chains));
+    BV(clib_bihash_foreach_key_value_pair)(&dt->dict->labels, chain_stats_kv, &args);
+}
+
+static u8 *format_histogram(u8 *s, const uword *hist, u32 first)
+{
+    for (u32 i = 0; i < DOMAIN_TRIE_STATS_HIST; i++)
+        s = format(s, " %u%s:%llu", first + i, i == DOMAIN_TRIE_STATS_HIST - 1 ? "+" : "", hist[i]);
+    return s;
+}
+
+static u8 *format_bihash_stats(u8 *s, va_list *args)
+{
+    char *name = va_arg(*args, char *);
+    domain_trie_bihash_stats_t *stats = va_arg(*args, domain_trie_bihash_stats_t *);
+
+    s = format(s, "%s: %llu entries in %llu buckets, load %.3f, %llu linear\n",
+               name, stats->entries, stats->nbuckets, stats->load, stats->linear_buckets);
+    s = format(s, "  entries per bucket:");
+    s = format_histogram(s, stats->occupancy, 0);
+    s = format(s, "\n  log2 pages:");
+    s = format_histogram(s, stats->log2_pages, 0);
+    return format(s, "\n");
+}
+
+u8 *format_domain_trie_hash_stats(u8 *s, va_list *args)
+{
+    domain_trie_hash_stats_t *stats = va_arg(*args, domain_trie_hash_stats_t *);
+
+    s = format(s, "%U", format_bihash_stats, TRIE_HASH_NAME, &stats->trie);
+    s = format(s, "%U", format_bihash_stats, LABEL_HASH_NAME, &stats->labels);
+    s = format(s, "%s chain length:", DOMAIN_LABEL_HASH_NAME);
+    s = format_histogram(s, stats->chains, 1);
+    return format(s, "\n");
+}
+
+static void bihash_mem(BVT(clib_bihash) *h, domain_trie_bihash_mem_t *mem)
+{
+    clib_memset(mem, 0, sizeof(*mem));
+    if (!h->instantiated)
+        return;
+
+    mem->buckets = h->nbuckets;
+    mem->bucket_bytes = h->nbuckets * sizeof(h->buckets[0]);
+    for (uword i = 0; i < h->nbuckets; i++) {
+        BVT(clib_bihash_bucket) *b = h->buckets + i;
+
+        if (!BV(clib_bihash_bucket_is_empty)(b))
+            mem->pages += 1 << b->log2_pages;
+    }
+    mem->page_bytes = mem->pages * sizeof(BVT(clib_bihash_value));
+    mem->arena_bytes = alloc_arena_next(h);
+}
+
+#define vec_mem(v, n_used, mem)                 \
+    do {                                        \
+        (mem)->used = (n_used);                 \
+        (mem)->capacity = vec_max_len(v);       \
+        (mem)->bytes = vec_mem_size(v);         \
+    } while (0)
+
+/*
+ * Where the memory goes, per component. Only what the trie allocated
+ * itself is counted: vppinfra heap overhead and the ru_maxrss slack of
+ * freed memory are not.
+ */
+void domain_trie_stats(domain_trie_t *dt, domain_trie_stats_t *stats)
+{
+    domain_trie_dict_t *d = dt->dict;
+
+    clib_memset(stats, 0, sizeof(*stats));
+
+    bihash_mem(&dt->trie, &stats->trie);
+    vec_mem(dt->nodes, pool_elts(dt->nodes), &stats->nodes);
+
+    bihash_mem(&d->labels, &stats->labels);
+    vec_mem(d->pool_labels, pool_elts(d->pool_labels), &stats->pool_labels);
+    vec_mem(d->filter, vec_len(d->filter), &stats->filter);
+    vec_mem(d->retired, vec_len(d->retired), &stats->retired);
+
+    for (int i = 0; i < 2; i++) {
+        u8 *arena = d->label_arena[i];
+
+        stats->label_arena.used += vec_len(arena);
+        stats->label_arena.capacity += vec_max_len(arena);
+        stats->label_arena.bytes += vec_mem_size(arena);
+    }
+    stats->label_garbage = d->label_arena_garbage;
+
+    /* A fixed clib_mem allocation, not a vec */
+    if (d->readers) {
+        for (u32 i = 0; i < DOMAIN_TRIE_MAX_READERS; i++)
+            stats->readers.used += d->readers[i].in_use;
+        stats->readers.capacity = DOMAIN_TRIE_MAX_READERS;
+        stats->readers.bytes = DOMAIN_TRIE_MAX_READERS * sizeof(domain_trie_reader_t);
+    }
+
+    stats->dict_refcount = d->refcount;
+    stats->dict_bytes = stats->labels.arena_bytes + stats->pool_labels.bytes + stats->label_arena.bytes +
+                        stats->filter.bytes + stats->readers.bytes + stats->retired.bytes;
+    stats->total_bytes = stats->trie.arena_bytes + stats->nodes.bytes + stats->dict_bytes;
+}
+
+static u8 *format_mem(u8 *s, va_list *args)
+{
+    char *name = va_arg(*args, char *);
+    domain_trie_mem_t *mem = va_arg(*args, domain_trie_mem_t *);
+
+    return format(s, "%s: %llu of %llu, %llu KB\n", name, mem->used, mem->capacity, mem->bytes >> 10);
+}
+
+static u8 *format_bihash_mem(u8 *s, va_list *args)
+{
+    char *name = va_arg(*args, char *);
+    domain_trie_bihash_mem_t *mem = va_arg(*args, domain_trie_bihash_mem_t *);
+
+    return format(s, "%s: %llu buckets %llu KB, %llu pages %llu KB, arena %llu KB\n", name, mem->buckets,
+                  mem->bucket_bytes >> 10, mem->pages, mem->page_bytes >> 10, mem->arena_bytes >> 10);
+}
+
+u8 *format_domain_trie_stats(u8 *s, va_list *args)
+{
+    domain_trie_stats_t *stats = va_arg(*args, domain_trie_stats_t *);
+
+    s = format(s, "%U", format_bihash_mem, TRIE_HASH_NAME, &stats->trie);
+    s = format(s, "%U", format_mem, "nodes", &stats->nodes);
+    s = format(s, "label dictionary, shared by %u: %llu KB\n", stats->dict_refcount, stats->dict_bytes >> 10);
+    s = format(s, "%U", format_bihash_mem, LABEL_HASH_NAME, &stats->labels);
+    s = format(s, "%U", format_mem, "labels", &stats->pool_labels);
+    s = format(s, "%U", format_mem, "label arena", &stats->label_arena);
+    s = format(s, "label garbage: %llu bytes\n", stats->label_garbage);
+    s = format(s, "%U", format_mem, "label filter", &stats->filter);
+    s = format(s, "%U", format_mem, "readers", &stats->readers);
+    s = format(s, "%U", format_mem, "retired", &stats->retired);
+    return format(s, "total: %llu KB\n", stats->total_bytes >> 10);
 }
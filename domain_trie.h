@@ -11,41 +11,365 @@
 #include <vppinfra/vec.h>
 #include <vppinfra/bihash_8_8.h>
 #include <vppinfra/bihash_template.h>
+#include "domain_cache.h"
+#include "domain_labels.h"
 
-#define DOMAIN_MAX 253
-#define LABEL_MAX 63
 #define LABEL_DLM "."
 #define TRIE_HASH_SIZE 1ULL<< 30
 #define TRIE_HASH_BUCKET 142867
 #define TRIE_HASH_NAME "domain_trie_ht"
-#define BACK_HASH_NAME "domain_back_ht"
 #define LABEL_HASH_NAME "domain_label_ht"
 
+#define DOMAIN_TRIE_ROOT 0
+#define DOMAIN_TRIE_INVALID_INDEX ((u32) ~0)
+#define DOMAIN_TRIE_NO_MATCH (~0ULL)
+#define DOMAIN_TRIE_BATCH 16
+#define DOMAIN_TRIE_LOAD_FACTOR 0.5       /* of each bucket's first page */
+#define DOMAIN_TRIE_LABELS_PER_PATTERN 4  /* for sizing from a pattern count */
+#define DOMAIN_TRIE_STATS_HIST 8
+#define DOMAIN_TRIE_FILTER_BITS_PER_KEY 16
+
+#define DOMAIN_TRIE_MAX_READERS 64
+#define DOMAIN_TRIE_ARENA_SLOT (1U << 31) /* label offset bit picking label_arena[1] */
+
+typedef struct {
+    u32 offset;  /* of the label bytes, DOMAIN_TRIE_ARENA_SLOT picks the arena */
+    u32 len;
+    u32 next;    /* next label with the same hash */
+    u32 counter; /* edges using this label, in every trie sharing it */
+} domain_trie_label_t;
+
+typedef struct {
+    u64 backendsets;    /* DOMAIN_TRIE_NO_MATCH unless a pattern ends here */
+    u32 wildcard_child; /* child for the "*" label */
+    u32 counter;        /* patterns ending at or below this node */
+} domain_trie_node_t;
+
+typedef struct {
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline0);
+    u64 epoch;  /* writer epoch seen on entry, 0 while outside a lookup */
+    u32 in_use;
+} domain_trie_reader_t;
+
 typedef enum {
-    UPDATE_COUNTER,
-    UPDATE_BACKENSETS,
-} update_field_t;
+    DOMAIN_TRIE_RETIRE_NODE,   /* pool_put a deleted node of the trie in p */
+    DOMAIN_TRIE_RETIRE_LABEL,  /* pool_put a deleted label */
+    DOMAIN_TRIE_RETIRE_NODES,  /* pool_free an outgrown copy of nodes */
+    DOMAIN_TRIE_RETIRE_LABELS, /* pool_free an outgrown copy of pool_labels */
+    DOMAIN_TRIE_RETIRE_ARENA,  /* vec_free an outgrown copy of a label arena */
+    DOMAIN_TRIE_RETIRE_SLOT,   /* vec_free a compacted arena and free its slot */
+    DOMAIN_TRIE_RETIRE_FILTER, /* vec_free a rebuilt-over label filter */
+} domain_trie_retire_t;
+
+typedef struct {
+    u64 epoch; /* writer epoch when it was unlinked */
+    domain_trie_retire_t what;
+    u32 index;
+    void *p;
+} domain_trie_retired_t;
+
+/*
+ * The label dictionary: every label's text, stored once for all the tries
+ * sharing it, see domain_trie_init_shared(). Readers and retired memory are
+ * kept here too, since a label or arena one trie retires may still be in
+ * use by a reader of another.
+ */
+typedef struct {
+    BVT(clib_bihash) labels;    /* domain_label_hash() -> first pool_labels index */
+    domain_trie_label_t *pool_labels;
+    u8 *label_arena[2];         /* every label's bytes, back to back */
+    u32 label_arena_slot;       /* the one new labels go to, the other one is empty or retired */
+    u32 label_arena_garbage;    /* bytes of deleted labels in the current arena */
+    u32 refcount;               /* tries using the dictionary */
+
+    /* Label filter, see domain_trie_enable_filter() */
+    u64 *filter;                /* vec of 512-bit blocks, 0 when disabled */
+    u32 filter_keys;            /* labels added since the last rebuild */
+    u32 filter_stale;           /* labels deleted since the last rebuild */
+
+    /* Concurrent readers, see domain_trie_enable_readers() */
+    domain_trie_reader_t *readers;
+    domain_trie_retired_t *retired; /* vec, waiting for readers to move on */
+    u64 epoch;
+} domain_trie_dict_t;
+
+/*
+ * Change journal, see domain_trie_journal_open(). The journal file starts
+ * with a domain_trie_journal_header_t, then holds one record per insert or
+ * delete: a domain_trie_journal_record_t and the pattern's labels, rightmost
+ * first, each behind its length byte. The checkpoint next to it holds the
+ * whole trie as of the journal's epoch.
+ */
+#define DOMAIN_TRIE_JOURNAL_MAGIC 0x4c4a5444    /* "DTJL" */
+#define DOMAIN_TRIE_CHECKPOINT_MAGIC 0x4b435444 /* "DTCK" */
+#define DOMAIN_TRIE_JOURNAL_VERSION 1
+#define DOMAIN_TRIE_JOURNAL_INSERT 1
+#define DOMAIN_TRIE_JOURNAL_DELETE 2
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 epoch;  /* the checkpoint this journal continues from */
+} domain_trie_journal_header_t;
+
+typedef struct {
+    u32 crc;         /* crc32c of the rest of the record, labels included */
+    u8 op;
+    u8 n_labels;
+    u8 len;          /* bytes of labels after the record */
+    u8 pad;
+    u64 backendsets;
+} domain_trie_journal_record_t;
+
+typedef struct {
+    u32 magic;
+    u32 version;
+    u64 epoch;
+    u32 n_nodes;
+    u32 n_labels;
+    u32 n_edges;
+    u32 label_bytes;            /* of label text, without the length bytes */
+    u32 wildcards[LABELS_MAX];
+} domain_trie_checkpoint_header_t;
 
 typedef struct {
-    u8 *data;
-    union {
-        u64 counter;
-        u64 backendsets;
-    };
-} hash_value_t;
+    int fd;                     /* -1 once a record or a checkpoint's journal failed */
+    u8 *path;                   /* vec, NUL terminated */
+    u64 epoch;
+    u64 bytes;                  /* journal file size */
+    u64 checkpoint_bytes;       /* checkpoint when the journal grows past it, 0 never */
+    u32 checkpoint_failures;    /* automatic checkpoints failed in a row */
+} domain_trie_journal_t;
 
 typedef struct  {
-    BVT(clib_bihash) trie;
-    BVT(clib_bihash) labels;
-    BVT(clib_bihash) backendsets;
-    hash_value_t *pool_trie;
-    hash_value_t *pool_labels;
-    hash_value_t *pool_backendsets;
+    BVT(clib_bihash) trie;      /* (parent node, label index) -> child node */
+    domain_trie_node_t *nodes;  /* pool, DOMAIN_TRIE_ROOT is the empty suffix */
+    domain_trie_dict_t *dict;
+    u32 wildcards[LABELS_MAX];  /* wildcard children at each label depth */
+    u64 generation;             /* bumped on every change, keys domain_cache_t */
+    domain_trie_journal_t *journal; /* 0 unless changes are journaled */
 } domain_trie_t;
 
+/* Histograms put everything at or past their last slot in that slot */
+typedef struct {
+    uword nbuckets;
+    uword entries;
+    uword linear_buckets;                     /* split to the limit, searched linearly */
+    uword occupancy[DOMAIN_TRIE_STATS_HIST];  /* buckets holding i entries */
+    uword log2_pages[DOMAIN_TRIE_STATS_HIST]; /* non-empty buckets split to 2^i pages */
+    f64 load;                                 /* entries / (nbuckets * BIHASH_KVP_PER_PAGE) */
+} domain_trie_bihash_stats_t;
+
+typedef struct {
+    domain_trie_bihash_stats_t trie;
+    domain_trie_bihash_stats_t labels;
+    uword chains[DOMAIN_TRIE_STATS_HIST];     /* label hash collision chains of i + 1 labels */
+} domain_trie_hash_stats_t;
+
+/* Bytes are what is allocated, used and capacity are in elements */
+typedef struct {
+    uword used;
+    uword capacity;
+    uword bytes;
+} domain_trie_mem_t;
+
+typedef struct {
+    uword buckets;
+    uword bucket_bytes;
+    uword pages;       /* kvp pages hanging off the buckets */
+    uword page_bytes;
+    uword arena_bytes; /* taken from the bihash arena, free lists included */
+} domain_trie_bihash_mem_t;
+
+/* Everything from labels down is the dictionary's, counted in full for each trie sharing it */
+typedef struct {
+    domain_trie_bihash_mem_t trie;
+    domain_trie_mem_t nodes;
+    domain_trie_bihash_mem_t labels;
+    domain_trie_mem_t pool_labels;
+    domain_trie_mem_t label_arena;    /* in bytes of label text, both slots */
+    uword label_garbage;              /* bytes of deleted labels in the current arena */
+    domain_trie_mem_t filter;         /* in 64-bit words */
+    domain_trie_mem_t readers;
+    domain_trie_mem_t retired;        /* entries waiting, not what they hold */
+    u32 dict_refcount;                /* tries sharing the label dictionary */
+    uword dict_bytes;
+    uword total_bytes;
+} domain_trie_stats_t;
+
+/*
+ * A frozen trie is one cache-line aligned allocation with no pointers in it:
+ * this header, then the edge table, the wildcard and backendsets arrays and
+ * the label text, each at a cache-line aligned byte offset from the header.
+ */
+typedef struct {
+    u32 parent;
+    u32 hash;   /* low 32 bits of domain_label_hash() */
+    u32 child;  /* DOMAIN_TRIE_INVALID_INDEX for an empty slot */
+    u32 label;  /* text offset of the length-prefixed label bytes */
+} domain_trie_frozen_edge_t;
+
+typedef struct {
+    CLIB_CACHE_LINE_ALIGN_MARK(cacheline0);
+    u32 n_nodes;
+    u32 log2_edges;       /* open-addressed, linear probing */
+    uword edges;          /* domain_trie_frozen_edge_t[1 << log2_edges] */
+    uword wildcard_child; /* u32[n_nodes] */
+    uword backendsets;    /* u64[n_nodes] */
+    uword text;
+    uword size;           /* of the whole image */
+} domain_trie_frozen_t;
+
+/*
+ * Reader-side element access. With readers enabled the writer may publish a
+ * grown copy of a pool or arena at any time, so the base pointer is loaded
+ * only after the index or offset that points into it.
+ */
+static_always_inline domain_trie_node_t *domain_trie_node_at(domain_trie_t *dt, u32 index)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&dt->nodes, __ATOMIC_RELAXED) + index;
+}
+
+static_always_inline domain_trie_label_t *domain_trie_dict_label_at(domain_trie_dict_t *d, u32 index)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&d->pool_labels, __ATOMIC_RELAXED) + index;
+}
+
+static_always_inline u8 *domain_trie_dict_label_data(domain_trie_dict_t *d, domain_trie_label_t *label)
+{
+    u32 offset = __atomic_load_n(&label->offset, __ATOMIC_ACQUIRE);
+    u8 *arena = __atomic_load_n(&d->label_arena[offset >> 31], __ATOMIC_RELAXED);
+
+    return arena + (offset & ~DOMAIN_TRIE_ARENA_SLOT);
+}
+
+static_always_inline domain_trie_label_t *domain_trie_label_at(domain_trie_t *dt, u32 index)
+{
+    return domain_trie_dict_label_at(dt->dict, index);
+}
+
+static_always_inline u8 *domain_trie_label_data(domain_trie_t *dt, domain_trie_label_t *label)
+{
+    return domain_trie_dict_label_data(dt->dict, label);
+}
+
+/*
+ * Split block Bloom filter over the hash of every label in the dictionary: a key
+ * picks one cache line and sets one bit in each of its eight words.
+ */
+static_always_inline u64 domain_trie_filter_hash(domain_label_hash_t hash)
+{
+    u64 h = hash;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static_always_inline u64 *domain_trie_filter_block(u64 *filter, u64 h)
+{
+    return filter + ((h >> 32) & (vec_len(filter) / 8 - 1)) * 8;
+}
+
+static_always_inline u64 domain_trie_filter_bit(u64 h, u32 word)
+{
+    static const u32 salt[8] = { 0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+                                 0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31 };
+
+    return 1ULL << (((u32)h * salt[word]) >> 26);
+}
+
+/*
+ * Set a bit in known for each label that may be in the trie, all of them
+ * when the filter is off. The probes do not depend on each other, so their
+ * misses overlap before the walk takes its first hash probe. Returns 0 if
+ * the lookup cannot match at all: a label the trie does not know has to be
+ * taken by a wildcard, and there is none at its depth.
+ */
+static_always_inline int domain_trie_filter_labels(domain_trie_t *dt, const domain_labels_t *labels,
+                                                   u64 known[2])
+{
+    u64 *filter = __atomic_load_n(&dt->dict->filter, __ATOMIC_ACQUIRE);
+
+    known[0] = known[1] = ~0ULL;
+    if (filter == NULL)
+        return 1;
+
+    for (u32 i = 0; i < labels->n_labels; i++)
+        clib_prefetch_load(domain_trie_filter_block(filter, domain_trie_filter_hash(labels->hash[i])));
+
+    for (u32 i = 0; i < labels->n_labels; i++) {
+        u64 h = domain_trie_filter_hash(labels->hash[i]);
+        u64 *block = domain_trie_filter_block(filter, h);
+        u64 miss = 0;
+
+        for (u32 j = 0; j < 8; j++)
+            miss |= ~block[j] & domain_trie_filter_bit(h, j);
+        if (miss) {
+            if (__atomic_load_n(&dt->wildcards[i], __ATOMIC_RELAXED) == 0)
+                return 0;
+            known[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Bracket every lookup, or a burst of them, with these once readers are
+ * enabled. They never wait: the writer defers freeing anything a reader
+ * may still see until every reader has left or re-entered.
+ */
+static_always_inline void domain_trie_read_lock(domain_trie_t *dt, u32 reader)
+{
+    domain_trie_dict_t *d = dt->dict;
+    domain_trie_reader_t *r = d->readers + reader;
+    u64 epoch;
+
+    do {
+        epoch = __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&r->epoch, epoch, __ATOMIC_SEQ_CST);
+    } while (epoch != __atomic_load_n(&d->epoch, __ATOMIC_SEQ_CST));
+}
+
+static_always_inline void domain_trie_read_unlock(domain_trie_t *dt, u32 reader)
+{
+    __atomic_store_n(&dt->dict->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+domain_trie_dict_t *domain_trie_dict_create(uword n_labels, uword label_bytes, f64 load_factor);
+void domain_trie_dict_unref(domain_trie_dict_t *d);
+
 void domain_trie_init(domain_trie_t *dt);
+void domain_trie_init_capacity(domain_trie_t *dt, uword n_patterns, f64 load_factor);
+void domain_trie_init_shared(domain_trie_t *dt, domain_trie_dict_t *d, uword n_patterns, f64 load_factor);
+void domain_trie_free(domain_trie_t *dt);
+void domain_trie_enable_readers(domain_trie_t *dt);
+u32 domain_trie_reader_register(domain_trie_t *dt);
+void domain_trie_reader_unregister(domain_trie_t *dt, u32 reader);
+void domain_trie_reclaim(domain_trie_t *dt);
+void domain_trie_enable_filter(domain_trie_t *dt);
 int domain_trie_insert(domain_trie_t *dt, const char *domain, u64 backendsets);
 u64 domain_trie_search(domain_trie_t *dt, const char *domain);
+u64 domain_trie_search_len(domain_trie_t *dt, const u8 *domain, uword len);
+u64 domain_trie_search_pipelined(domain_trie_t *dt, const u8 *domain, uword len);
+u64 domain_trie_search_cached(domain_trie_t *dt, domain_cache_t *cache, const char *domain);
+void domain_trie_search_batch(domain_trie_t *dt, const u8 **domains, const uword *lens, u32 n, u64 *results);
 int domain_trie_delete(domain_trie_t *dt, const char *domain);
+int domain_trie_load_file(domain_trie_t *dt, const char *path);
+int domain_trie_journal_open(domain_trie_t *dt, const char *path, u64 checkpoint_bytes);
+int domain_trie_checkpoint(domain_trie_t *dt);
+void domain_trie_journal_close(domain_trie_t *dt);
+domain_trie_frozen_t *domain_trie_freeze(domain_trie_t *dt);
+void domain_trie_frozen_free(domain_trie_frozen_t *ft);
+u64 domain_trie_search_frozen(const domain_trie_frozen_t *ft, const u8 *domain, uword len);
+void domain_trie_hash_stats(domain_trie_t *dt, domain_trie_hash_stats_t *stats);
+u8 *format_domain_trie_hash_stats(u8 *s, va_list *args);
+void domain_trie_stats(domain_trie_t *dt, domain_trie_stats_t *stats);
+u8 *format_domain_trie_stats(u8 *s, va_list *args);
 
 #endif
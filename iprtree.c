@@ -26,6 +26,74 @@ iprtree_clear (iprtree_container_t *container, iprtree_t *tree)
 
   vec_free (to_remove);
 }
+
+uword
+iprtree_memory_size (iprtree_container_t *container)
+{
+  return pool_len (container->nodes) * sizeof (container->nodes[0]) +
+	 vec_len (container->children) * sizeof (container->children[0]) +
+	 vec_len (container->skip_strs);
+}
+
+/* Lays out the children of by_char selected by bitmap, at offset in
+ * container->children when they do not fit inline */
+static_always_inline void
+iprtree_node_set_children (iprtree_container_t *container,
+			   iprtree_node_t *node, u64 bitmap,
+			   iprtree_node_index_t *by_char, u32 offset)
+{
+  u8 full = count_set_bits (bitmap) > IPRTREE_SPARSE_MAX;
+  iprtree_node_index_t *slots;
+  u64 bits;
+  u32 n = 0;
+
+  node->bitmap = bitmap;
+  if (bitmap == 0)
+    node->children = IPRTREE_INVALID_INDEX;
+  else if (iprtree_children_class (count_set_bits (bitmap)) == (u8) ~0)
+    node->children = by_char[count_trailing_zeros (bitmap)];
+  else
+    {
+      node->children = offset;
+      slots = container->children + offset;
+      for (bits = bitmap; bits; bits &= bits - 1)
+	{
+	  u8 c = count_trailing_zeros (bits);
+	  slots[full ? c : n++] = by_char[c];
+	}
+    }
+}
+
+/* Add or remove the child of a converted char, moving the children to the
+ * layout and block size of the new child count when it changes */
+static_always_inline void
+iprtree_internal_node_toggle_child (iprtree_container_t *container,
+				    iprtree_node_t *node, u8 converted,
+				    iprtree_node_index_t target)
+{
+  iprtree_node_index_t by_char[64];
+  u64 bitmap = node->bitmap ^ (1ULL << converted);
+  u8 old_class = iprtree_children_class (count_set_bits (node->bitmap));
+  u8 class = iprtree_children_class (count_set_bits (bitmap));
+  u32 offset = node->children;
+  u64 bits;
+
+  for (bits = node->bitmap; bits; bits &= bits - 1)
+    by_char[count_trailing_zeros (bits)] =
+      iprtree_node_child (container, node, count_trailing_zeros (bits));
+  by_char[converted] = target;
+
+  if (class != old_class)
+    {
+      if (old_class != (u8) ~0)
+	iprtree_children_free (container, node->children, old_class);
+      if (class != (u8) ~0)
+	offset = iprtree_children_alloc (container, class);
+    }
+
+  iprtree_node_set_children (container, node, bitmap, by_char, offset);
+}
+
 static_always_inline void
 iprtree_internal_node_set_child (iprtree_container_t *container,
 				 iprtree_node_t *node, u8 char_to_set,
@@ -36,18 +104,19 @@ iprtree_internal_node_set_child (iprtree_container_t *container,
   iprtree_node_t /**old_target_node, */ *target_node = NULL;
 
   converted = iprtree_conversion[char_to_set];
-  old_target = node->by_prev_letter[converted];
-  if (old_target != IPRTREE_INVALID_INDEX)
-    {
-      /*old_target_node = iprtree_node_at_index (container, old_target);*/
-      node->n_children -= 1;
-    }
+  ASSERT (converted != (u8) ~0);
+  old_target = iprtree_node_child (container, node, converted);
   if (target != IPRTREE_INVALID_INDEX)
+    target_node = iprtree_node_at_index (container, target);
+  if (old_target == IPRTREE_INVALID_INDEX ||
+      target == IPRTREE_INVALID_INDEX)
     {
-      node->n_children += 1;
-      target_node = iprtree_node_at_index (container, target);
+      if (target != old_target)
+	iprtree_internal_node_toggle_child (container, node, converted,
+					    target);
     }
-  node->by_prev_letter[converted] = target;
+  else
+    iprtree_node_child_slot (container, node, converted)[0] = target;
   if (target != old_target)
     {
       if (target_node)
@@ -58,82 +127,20 @@ iprtree_internal_node_set_child (iprtree_container_t *container,
     }
 };
 
-void
-iprtree_internal_node_set_default_target (
-  iprtree_container_t *container, iprtree_node_index_t internal_node_index,
-  iprtree_node_index_t target_node)
+/* Whether every char of the pattern converts. Lookups check their input
+ * against IPRTREE_ALLOWED_CHARS, patterns are only checked here. */
+static_always_inline int
+iprtree_pattern_is_valid (u8 *pattern, uword len)
 {
-  iprtree_t subtree;
-  iprtree_iterator_t it;
-  subtree.iprtree_root_node_index = internal_node_index;
-  iprtree_node_index_t *to_process = 0;
-  iprtree_node_index_t *to_process_current = 0;
-  iprtree_foreach_node (it, container, &subtree)
-  {
-    iprtree_node_index_t ni = iprtree_iterator_get_current (&it);
-    iprtree_node_t *current_node = iprtree_node_at_index (container, ni);
-    if (current_node->type == IPRTREE_NODE_TYPE_INTERNAL)
-      vec_add1 (to_process, ni);
-  }
-  vec_foreach (to_process_current, to_process)
-    {
-      iprtree_node_index_t lni = to_process_current[0];
-      iprtree_node_t *base_node =
-	iprtree_node_at_index (container, to_process_current[0]);
-      iprtree_node_t *current_node;
-      iprtree_node_index_t saved_children[IPRTREE_ARITY];
-      clib_memcpy (&saved_children, &base_node->by_prev_letter,
-		   sizeof (base_node->by_prev_letter));
-      /* Clear children of the base node */
-      for (int i = 0; i < IPRTREE_ARITY; i++)
-	{
-	  if (base_node->by_prev_letter[i] != IPRTREE_INVALID_INDEX)
-	    {
-	      /* lock it */
-	      current_node = iprtree_node_at_index (
-		container, base_node->by_prev_letter[i]);
-	      iprtree_node_ref_inc (current_node);
-	    }
-	  iprtree_internal_node_set_child (
-	    container, base_node, inversed_iprtree_conversion[i], target_node);
-	  base_node = iprtree_node_at_index (container, to_process_current[0]);
-	}
-
-      current_node = iprtree_node_at_index (container, lni);
-      while (base_node->n_skip)
-	{
-	  u8 last_char = base_node->skip_str[base_node->n_skip - 1];
-	  base_node->n_skip -= 1;
-	  iprtree_node_index_t nni =
-	    iprtree_allocate_internal_node_with_default_leaf (container,
-							      target_node);
-	  current_node = iprtree_node_at_index (container, lni);
-	  iprtree_internal_node_set_child (container, current_node, last_char,
-					   nni);
-	  iprtree_free_node (container, nni);
-
-	  base_node = iprtree_node_at_index (container, to_process_current[0]);
-	  lni = nni;
-	}
-      current_node = iprtree_node_at_index (container, lni);
-
-      /* Restore saved children */
-      for (int i = 0; i < IPRTREE_ARITY; i++)
-	{
-	  if (saved_children[i] != IPRTREE_INVALID_INDEX)
-	    {
-	      iprtree_internal_node_set_child (container, current_node,
-					       inversed_iprtree_conversion[i],
-					       saved_children[i]);
-	      iprtree_free_node (container, saved_children[i]);
-	    }
-	}
-    }
-
-  vec_free (to_process);
+  for (uword i = 0; i < len; i++)
+    if (iprtree_conversion[pattern[i]] == (u8) ~0)
+      return 0;
+  return 1;
 }
 
-void
+/* Returns -1, and leaves the tree alone, if the pattern has a char outside
+ * IPRTREE_ALLOWED_CHARS */
+int
 iprtree_insert_pattern (iprtree_container_t *container, iprtree_t *tree,
 			u8 *pattern, iprtree_leaf_index_t target)
 {
@@ -142,188 +149,700 @@ iprtree_insert_pattern (iprtree_container_t *container, iprtree_t *tree,
   iprtree_node_t *node, *new_node;
   iprtree_node_t *internal_node;
   iprtree_leaf_index_t old_target;
+  iprtree_node_index_t default_leaf;
   uword remain_len;
-  uword n_skip_in_node;
+  uword n_skip_in_node = 0, n_skip;
   u8 last_char;
   u8 exhausted_str;
 
   remain_len = vec_len (pattern);
-  ni =
-    iprtree_consume_str (container, tree, pattern, &remain_len,
-			 &n_skip_in_node, &ini, &exhausted_str, &old_target);
+  if (!iprtree_pattern_is_valid (pattern, remain_len))
+    return -1;
+  ni = iprtree_consume_str (container, tree, pattern, &remain_len,
+			    &n_skip_in_node, &ini, &exhausted_str, &old_target,
+			    &default_leaf);
 
   if (old_target != IPRTREE_INVALID_INDEX)
     {
       node = iprtree_node_at_index (container, ni);
-      internal_node = iprtree_node_at_index (container, ini);
 
       /* We matched a leaf! */
       ASSERT (node->type == IPRTREE_NODE_TYPE_LEAF);
-      last_char = pattern[remain_len];
 
-      /* Insert intermediate internal nodes if not exact match */
-      iprtree_node_ref_inc (node);
-      while (remain_len > 0)
+      /* Same pattern again, the last one wins */
+      if (remain_len == 0)
 	{
-	  nni =
-	    iprtree_allocate_internal_node_with_default_leaf (container, ni);
-	  new_node = iprtree_node_at_index (container, nni);
-	  internal_node = iprtree_node_at_index (container, ini);
-
-	  /* Only skip strings if we are not matching an existing wildcard
-	   * pattern */
-	  if (ni == IPRTREE_INVALID_INDEX)
-	    new_node->n_skip =
-	      clib_min (remain_len - 1, ARRAY_LEN (new_node->skip_str));
-
-	  clib_memcpy (new_node->skip_str,
-		       pattern + remain_len - new_node->n_skip,
-		       new_node->n_skip);
-	  remain_len -= new_node->n_skip;
-	  iprtree_internal_node_set_child (container, internal_node, last_char,
-					   nni);
-	  /* Don't need a ref to the inserted node anymore because it's in the
-	   * tree */
-	  iprtree_free_node (container, nni);
-	  ASSERT (remain_len > 0);
-	  remain_len -= 1;
-	  last_char = pattern[remain_len];
-	  ini = nni;
+	  node->target = target;
+	  return 0;
 	}
+
+      /* Only a wildcard leaf can be left with chars to consume: replace it
+       * with an internal node that keeps it as default leaf, and insert below
+       * that node */
+      last_char = pattern[remain_len];
+      nni = iprtree_allocate_internal_node (container);
+      new_node = iprtree_node_at_index (container, nni);
       node = iprtree_node_at_index (container, ni);
+      iprtree_internal_node_toggle_child (container, new_node,
+					  IPRTREE_DEFAULT_CHILD, ni);
+      iprtree_node_ref_inc (node);
       internal_node = iprtree_node_at_index (container, ini);
+      iprtree_internal_node_set_child (container, internal_node, last_char,
+				       nni);
+      iprtree_free_node (container, nni);
+
+      ini = nni;
+      ni = IPRTREE_INVALID_INDEX;
+      n_skip_in_node = 0;
+      exhausted_str = 0;
+      remain_len -= 1;
+    }
 
-      /* If unique ref to the leaf, can be reused */
-      if (node->ref_cnt == 1)
-	{
-	  node->target = target;
-	  iprtree_internal_node_set_child (container, internal_node, last_char,
-					   ni);
-	}
-      else
-	{
-	  /* Need to allocate a new leaf */
-	  nni = iprtree_allocate_leaf_node (container, target);
-	  internal_node = iprtree_node_at_index (container, ini);
+  /* We reached an internal node, not a leaf */
+  /* Failed the skip_str ?*/
+  if (ni != IPRTREE_INVALID_INDEX && n_skip_in_node > 0)
+    {
+      u8 total_to_be_skipped;
+      u8 skip_str[IPRTREE_SKIP_MAX];
+      /* Create intermediary node exactly where the failure happened */
+      nni = iprtree_allocate_internal_node (container);
 
-	  iprtree_internal_node_set_child (container, internal_node, last_char,
-					   nni);
-	  iprtree_free_node (container, nni);
-	}
-      iprtree_free_node (container, ni);
+      new_node = iprtree_node_at_index (container, nni);
+      node = iprtree_node_at_index (container, ni);
+      internal_node = iprtree_node_at_index (container, ini);
+      total_to_be_skipped = node->n_skip;
+      /* The skip string moves to the arena and back, copy it out first.
+       * The failed char */
+      clib_memcpy (skip_str, iprtree_node_skip_str (container, node),
+		   node->n_skip);
+      last_char = skip_str[n_skip_in_node - 1];
+
+      /* Copy what was already matched in the new node */
+      iprtree_node_clear_skip_str (container, node);
+      iprtree_node_set_skip_str (container, new_node,
+				 skip_str + n_skip_in_node,
+				 total_to_be_skipped - n_skip_in_node);
+      /* Trim what was already matched off the old node + 1 */
+      iprtree_node_set_skip_str (container, node, skip_str,
+				 n_skip_in_node - 1);
+
+      /* Insert the old internal node as kid of the new one */
+      iprtree_internal_node_set_child (container, new_node, last_char, ni);
+
+      /* Insert the new internal node as kid of the last successful
+       * internal node */
+      internal_node = iprtree_node_at_index (container, ini);
+      iprtree_internal_node_set_child (
+	container, internal_node,
+	pattern[remain_len + total_to_be_skipped - n_skip_in_node], nni);
+
+      /* The new internal node is in tree, we don't need a ref anymore */
+      iprtree_free_node (container, nni);
+
+      ini = nni;
+      ni = IPRTREE_INVALID_INDEX;
+      n_skip_in_node = 0;
+
+      /* Set ourselves up in the invalid index case */
+      remain_len -= 1;
     }
-  else
+  /* Current issue is that we have not reached a leaf because of invalid
+   * index or because of exhausted string  */
+  /* If string is exhausted, it means that we are matching a wildcard
+   * because 0 can only be consumed by a leaf */
+  if (exhausted_str)
     {
-      /* We reached an internal node, not a leaf */
-      /* Failed the skip_str ?*/
-      if (ni != IPRTREE_INVALID_INDEX && n_skip_in_node > 0)
+      /* String exhaustion means that we haven't stop on 0 because 0 is
+       * necessary a leaf* so we are inserting a wildcard pattern: every
+       * lookup going through this node falls back to it */
+      ASSERT (pattern[0] != 0);
+      internal_node = iprtree_node_at_index (container, ini);
+      nli = iprtree_node_child (container, internal_node,
+				IPRTREE_DEFAULT_CHILD);
+      if (nli != IPRTREE_INVALID_INDEX)
 	{
-	  u8 total_to_be_skipped;
-	  /* Create intermediary node exactly where the failure happened */
-	  nni = iprtree_allocate_internal_node (container);
-
-	  new_node = iprtree_node_at_index (container, nni);
-	  node = iprtree_node_at_index (container, ni);
-	  internal_node = iprtree_node_at_index (container, ini);
-	  total_to_be_skipped = node->n_skip;
-	  /* The failed char */
-	  last_char = node->skip_str[n_skip_in_node - 1];
-
-	  /* Copy what was already matched in the new node */
-	  new_node->n_skip = node->n_skip - n_skip_in_node;
-	  clib_memcpy (new_node->skip_str,
-		       &node->skip_str[node->n_skip - new_node->n_skip],
-		       new_node->n_skip);
-	  /* Trim what was already matched off the old node + 1 */
-	  node->n_skip = n_skip_in_node - 1;
-
-	  /* Insert the old internal node as kid of the new one */
-	  iprtree_internal_node_set_child (container, new_node, last_char, ni);
-
-	  /* Insert the new internal node as kid of the last successful
-	   * internal node */
-	  internal_node = iprtree_node_at_index (container, ini);
-	  iprtree_internal_node_set_child (
-	    container, internal_node,
-	    pattern[remain_len + total_to_be_skipped - n_skip_in_node], nni);
-
-	  /* The new internal node is in tree, we don't need a ref anymore */
-	  iprtree_free_node (container, nni);
-
-	  ini = nni;
-	  ni = IPRTREE_INVALID_INDEX;
-	  n_skip_in_node = 0;
-
-	  /* Set ourselves up in the invalid index case */
-	  remain_len -= 1;
+	  /* Same pattern again, the last one wins */
+	  iprtree_node_at_index (container, nli)->target = target;
+	  return 0;
 	}
-      internal_node = iprtree_node_at_index (container, ini);
-      /* Current issue is that we have not reached a leaf because of invalid
-       * index or because of exhausted string  */
-      /* If string is exhausted, it means that we are matching a wildcard
-       * because 0 can only be consumed by a leaf */
       nli = iprtree_allocate_leaf_node (container, target);
-      if (exhausted_str)
-	{
-	  internal_node = iprtree_node_at_index (container, ini);
-	  /* No other reason to stop except string exhaustion */
-	  // ASSERT (remain_len == 0);
+      internal_node = iprtree_node_at_index (container, ini);
+      iprtree_internal_node_toggle_child (container, internal_node,
+					  IPRTREE_DEFAULT_CHILD, nli);
+      return 0;
+    }
+
+  nli = iprtree_allocate_leaf_node (container, target);
+  last_char = pattern[remain_len];
+  ASSERT (ni == IPRTREE_INVALID_INDEX);
+  internal_node = iprtree_node_at_index (container, ini);
+  while (remain_len > 0)
+    {
+      nni = iprtree_allocate_internal_node (container);
+      new_node = iprtree_node_at_index (container, nni);
+      internal_node = iprtree_node_at_index (container, ini);
+
+      n_skip = clib_min (remain_len - 1, IPRTREE_SKIP_MAX);
+      iprtree_node_set_skip_str (container, new_node,
+				 pattern + remain_len - n_skip, n_skip);
+      remain_len -= n_skip;
+      ASSERT (remain_len > 0);
+      iprtree_internal_node_set_child (container, internal_node, last_char,
+				       nni);
+      /* Don't need a ref to the new node */
+      iprtree_free_node (container, nni);
+      remain_len -= 1;
+      last_char = pattern[remain_len];
+      ini = nni;
+      internal_node = new_node;
+    }
+  internal_node = iprtree_node_at_index (container, ini);
+  iprtree_internal_node_set_child (container, internal_node, last_char, nli);
+  iprtree_free_node (container, nli);
+  return 0;
+}
+
+/* Removes the pattern from the tree, then drops the internal nodes it
+ * leaves without children and folds the last one left into its only child
+ * when the skip strings fit. Returns -1 if the tree does not hold it. */
+int
+iprtree_delete_pattern (iprtree_container_t *container, iprtree_t *tree,
+			u8 *pattern)
+{
+  iprtree_node_index_t ni = tree->iprtree_root_node_index, li;
+  iprtree_node_index_t *path = 0;
+  iprtree_node_t *node, *child;
+  uword remain_len = vec_len (pattern);
+  u8 *path_chars = 0;
+  u8 converted;
+  int rv = -1;
+
+  if (ni == IPRTREE_INVALID_INDEX)
+    return -1;
+
+  /* Walk down to the leaf, or to the internal node right after which a
+   * wildcard pattern ends */
+  while (1)
+    {
+      node = iprtree_node_at_index (container, ni);
+      if (node->type == IPRTREE_NODE_TYPE_LEAF)
+	break;
+      if (node->n_skip > remain_len ||
+	  memcmp (pattern + remain_len - node->n_skip,
+		  iprtree_node_skip_str (container, node), node->n_skip))
+	goto done;
+      remain_len -= node->n_skip;
+      vec_add1 (path, ni);
+      if (remain_len == 0)
+	break;
+      remain_len -= 1;
+      converted = iprtree_conversion[pattern[remain_len]];
+      if (converted == (u8) ~0)
+	goto done;
+      vec_add1 (path_chars, pattern[remain_len]);
+      ni = iprtree_node_child (container, node, converted);
+      if (ni == IPRTREE_INVALID_INDEX)
+	goto done;
+    }
+
+  if (node->type == IPRTREE_NODE_TYPE_LEAF)
+    {
+      /* A longer pattern only reaches a wildcard leaf that covers it */
+      if (remain_len)
+	goto done;
+      node = iprtree_node_at_index (container, vec_end (path)[-1]);
+      iprtree_internal_node_set_child (container, node, vec_pop (path_chars),
+				       IPRTREE_INVALID_INDEX);
+    }
+  else
+    {
+      li = iprtree_node_child (container, node, IPRTREE_DEFAULT_CHILD);
+      if (li == IPRTREE_INVALID_INDEX)
+	goto done;
+      iprtree_internal_node_toggle_child (container, node,
+					  IPRTREE_DEFAULT_CHILD,
+					  IPRTREE_INVALID_INDEX);
+      iprtree_free_node (container, li);
+    }
+  rv = 0;
+
+  /* path_chars[i] now selects path[i + 1] under path[i]; never touch the
+   * root */
+  while (vec_len (path) > 1)
+    {
+      node = iprtree_node_at_index (container, vec_end (path)[-1]);
+      if (node->bitmap)
+	break;
+      vec_dec_len (path, 1);
+      node = iprtree_node_at_index (container, vec_end (path)[-1]);
+      iprtree_internal_node_set_child (container, node, vec_pop (path_chars),
+				       IPRTREE_INVALID_INDEX);
+    }
+
+  if (vec_len (path) > 1)
+    {
+      ni = vec_end (path)[-1];
+      node = iprtree_node_at_index (container, ni);
+      /* Only one child, and no default leaf */
+      if (node->bitmap & (node->bitmap - 1))
+	goto done;
+      converted = count_trailing_zeros (node->bitmap);
+      if (converted == IPRTREE_DEFAULT_CHILD)
+	goto done;
+      li = node->children;
+      child = iprtree_node_at_index (container, li);
+      if (child->type != IPRTREE_NODE_TYPE_INTERNAL ||
+	  node->n_skip + 1 + child->n_skip > IPRTREE_SKIP_MAX)
+	goto done;
+
+      /* The child skips its own chars, the selecting char, then ours */
+      u8 skip_str[IPRTREE_SKIP_MAX];
+      uword n_skip = child->n_skip;
+      clib_memcpy (skip_str, iprtree_node_skip_str (container, child),
+		   n_skip);
+      skip_str[n_skip++] = inversed_iprtree_conversion[converted];
+      clib_memcpy (skip_str + n_skip, iprtree_node_skip_str (container, node),
+		   node->n_skip);
+      n_skip += node->n_skip;
+
+      iprtree_node_ref_inc (child);
+      iprtree_internal_node_set_child (container, node,
+				       inversed_iprtree_conversion[converted],
+				       IPRTREE_INVALID_INDEX);
+      iprtree_node_clear_skip_str (container, child);
+      iprtree_node_set_skip_str (container, child, skip_str, n_skip);
+      node = iprtree_node_at_index (container, vec_end (path)[-2]);
+      iprtree_internal_node_set_child (container, node,
+				       vec_end (path_chars)[-1], li);
+      iprtree_free_node (container, li);
+    }
+
+done:
+  vec_free (path);
+  vec_free (path_chars);
+  return rv;
+}
+
+/* A pattern and the first 8 chars the tree consumes from it, packed so that
+ * comparing keys compares them. After sorting, the key is replaced with the
+ * number of chars the pattern has in common with the one before. */
+typedef struct
+{
+  union
+  {
+    u64 key;
+    u64 n_common;
+  };
+  u8 *str;
+  u32 len;
+  iprtree_leaf_index_t target;
+} iprtree_build_key_t;
+
+/* Orders patterns by their reversed string, the order the tree consumes
+ * them in */
+static int
+iprtree_build_key_cmp (void *a1, void *a2)
+{
+  iprtree_build_key_t *k1 = a1, *k2 = a2;
+  u8 *s1 = k1->str, *s2 = k2->str;
+  uword l1 = k1->len, l2 = k2->len;
+
+  if (k1->key != k2->key)
+    return k1->key < k2->key ? -1 : 1;
+  for (uword i = 0; i < l1 && i < l2; i++)
+    if (s1[l1 - 1 - i] != s2[l2 - 1 - i])
+      return (int) s1[l1 - 1 - i] - (int) s2[l2 - 1 - i];
+  return (l1 > l2) - (l1 < l2);
+}
+
+/* Radix sort on the keys, one pass per byte that is not the same in all of
+ * them, then comparison sort of the runs of equal keys. Returns the sorted
+ * vec, keys or a copy of it, and frees the other one. */
+static iprtree_build_key_t *
+iprtree_build_sort (iprtree_build_key_t *keys)
+{
+  iprtree_build_key_t *tmp = 0, *swap;
+  u32 n = vec_len (keys), counts[8][256] = { 0 }, offsets[256], i, j;
+
+  if (n < 2)
+    return keys;
+
+  for (i = 0; i < n; i++)
+    for (j = 0; j < 8; j++)
+      counts[j][(keys[i].key >> (8 * j)) & 0xff]++;
+
+  vec_validate (tmp, n - 1);
+  for (j = 0; j < 8; j++)
+    {
+      if (counts[j][(keys[0].key >> (8 * j)) & 0xff] == n)
+	continue;
+      offsets[0] = 0;
+      for (i = 1; i < 256; i++)
+	offsets[i] = offsets[i - 1] + counts[j][i - 1];
+      for (i = 0; i < n; i++)
+	tmp[offsets[(keys[i].key >> (8 * j)) & 0xff]++] = keys[i];
+      swap = keys;
+      keys = tmp;
+      tmp = swap;
+    }
+  vec_free (tmp);
+
+  for (i = 0; i < n; i = j)
+    {
+      for (j = i + 1; j < n && keys[j].key == keys[i].key; j++)
+	;
+      if (j - i > 1)
+	qsort (keys + i, j - i, sizeof (keys[0]),
+	       (void *) iprtree_build_key_cmp);
+    }
+  return keys;
+}
+
+/* An internal node on the path of the last pattern, not filled in yet.
+ * Positions count consumed chars: the skip string covers [start, sel) and
+ * the char at sel selects the child on the path. */
+typedef struct
+{
+  iprtree_node_index_t ni;
+  u32 start;
+  u32 sel;
+  u64 bitmap;
+  iprtree_node_index_t by_char[IPRTREE_DEFAULT_CHILD + 1];
+} iprtree_build_node_t;
+
+/* Position of the first selecting char of a pattern left after consuming
+ * [c, len): its skip string is as long as a node takes */
+static_always_inline uword
+iprtree_build_next_sel (uword c, uword len)
+{
+  return c + clib_min (len - c - 1, IPRTREE_SKIP_MAX);
+}
+
+/* Both passes over the sorted keys miss on every string, the build loads
+ * the ones ahead. Strings are consumed from their end. */
+#define IPRTREE_BUILD_PREFETCH 4
+
+static_always_inline void
+iprtree_build_prefetch (iprtree_build_key_t *keys, iprtree_build_key_t *k)
+{
+  k += IPRTREE_BUILD_PREFETCH;
+  if (k < vec_end (keys) && k->len)
+    clib_prefetch_load (k->str + k->len - 1);
+}
 
-	  /* String exhaustion means that we haven't stop on 0 because 0 is
-	   * necessary a leaf* so we are inserting a wildcard pattern */
-	  ASSERT (pattern[0] != 0);
+/* Sets n_common of the sorted keys and returns the number of nodes
+ * iprtree_build() allocates for them, by walking the same path stack with
+ * only the selecting positions */
+static uword
+iprtree_build_count (iprtree_build_key_t *keys)
+{
+  iprtree_build_key_t *k;
+  u8 *s, *ps = 0;
+  uword n_nodes = 0, len, prev_len = 0, d;
+  u32 *sels = 0;
 
-	  for (int i = 0; i < IPRTREE_ARITY; i++)
+  vec_add1 (sels, 0);
+  vec_foreach (k, keys)
+    {
+      iprtree_build_prefetch (keys, k);
+      s = k->str;
+      len = k->len;
+      k->n_common = 0;
+      n_nodes += 1;
+      if (len == 0)
+	continue;
+
+      d = 0;
+      if (ps)
+	{
+	  while (d < len && d < prev_len &&
+		 s[len - 1 - d] == ps[prev_len - 1 - d])
+	    d++;
+	  k->n_common = d;
+	  if (d == prev_len)
 	    {
-	      if (internal_node->by_prev_letter[i] == IPRTREE_INVALID_INDEX)
-		{
-		  iprtree_internal_node_set_child (
-		    container, internal_node, inversed_iprtree_conversion[i],
-		    nli);
-		}
-	      else
+	      vec_add1 (sels, d);
+	      n_nodes += 1;
+	    }
+	  else
+	    {
+	      while (vec_len (sels) > 1 && vec_end (sels)[-2] + 1 > d)
+		vec_dec_len (sels, 1);
+	      if (d < vec_end (sels)[-1])
 		{
-		  /* Set default value for the internal node */
-		  iprtree_internal_node_set_default_target (
-		    container, internal_node->by_prev_letter[i], nli);
+		  vec_end (sels)[-1] = d;
+		  n_nodes += 1;
 		}
-	      internal_node = iprtree_node_at_index (container, ini);
 	    }
 	}
-      else
+      for (uword c = d + 1; c < len; c = vec_end (sels)[-1] + 1)
 	{
-	  last_char = pattern[remain_len];
-	  ASSERT (ni == IPRTREE_INVALID_INDEX);
-	  internal_node = iprtree_node_at_index (container, ini);
-	  while (remain_len > 0)
+	  vec_add1 (sels, iprtree_build_next_sel (c, len));
+	  n_nodes += 1;
+	}
+      ps = s;
+      prev_len = len;
+    }
+  vec_free (sels);
+  return n_nodes;
+}
+
+static_always_inline void
+iprtree_build_add_child (iprtree_build_node_t *b, u8 converted,
+			 iprtree_node_index_t child)
+{
+  b->by_char[converted] = child;
+  b->bitmap |= 1ULL << converted;
+}
+
+static_always_inline iprtree_build_node_t *
+iprtree_build_push (iprtree_container_t *container,
+		    iprtree_build_node_t **stack, u32 start, u32 sel)
+{
+  iprtree_build_node_t *b;
+
+  vec_add2 (*stack, b, 1);
+  b->ni = iprtree_allocate_internal_node (container);
+  b->start = start;
+  b->sel = sel;
+  b->bitmap = 0;
+  return b;
+}
+
+/* Fills in the node of b with its final skip string and children. str is a
+ * pattern on its path. */
+static iprtree_node_index_t
+iprtree_build_emit (iprtree_container_t *container, iprtree_build_node_t *b,
+		    u8 *str, uword len)
+{
+  u8 class = iprtree_children_class (count_set_bits (b->bitmap));
+  u32 offset =
+    class == (u8) ~0 ? 0 : iprtree_children_alloc (container, class);
+  iprtree_node_t *node = iprtree_node_at_index (container, b->ni);
+
+  if (b->sel > b->start)
+    iprtree_node_set_skip_str (container, node, str + len - b->sel,
+			       b->sel - b->start);
+  iprtree_node_set_children (container, node, b->bitmap, b->by_char, offset);
+  return b->ni;
+}
+
+/* Builds the tree from scratch out of a vec of distinct patterns. Sorted by
+ * reversed string, each pattern leaves the path of the one before at their
+ * longest common suffix, so the tree only ever grows along its last path.
+ * That path is kept on a stack, and its nodes are filled in with their final
+ * skip strings and children once no later pattern can reach them. Nodes are
+ * allocated in the order iprtree_insert_pattern() allocates them, and the
+ * result is the tree it builds from the same patterns in sorted order, down
+ * to the node indices. The root must have no children yet. Patterns with a
+ * char outside IPRTREE_ALLOWED_CHARS are left out, and -1 is returned if
+ * there were any. */
+int
+iprtree_build (iprtree_container_t *container, iprtree_t *tree,
+	       iprtree_pattern_t *patterns)
+{
+  iprtree_build_node_t *stack = 0, *b, lower;
+  iprtree_node_index_t child = IPRTREE_INVALID_INDEX;
+  iprtree_build_key_t *keys = 0, *k;
+  uword len, prev_len = 0, d, n_nodes, n_free;
+  u8 *s, *ps = 0;
+  int rv = 0;
+
+  ASSERT (iprtree_node_at_index (container, tree->iprtree_root_node_index)
+	    ->bitmap == 0);
+
+  vec_alloc (keys, vec_len (patterns));
+  for (u32 i = 0; i < vec_len (patterns); i++)
+    {
+      s = patterns[i].str;
+      len = vec_len (s);
+      if (!iprtree_pattern_is_valid (s, len))
+	{
+	  rv = -1;
+	  continue;
+	}
+      vec_add2 (keys, k, 1);
+      k->key = 0;
+      for (uword j = 0; j < sizeof (k->key); j++)
+	k->key = k->key << 8 | (j < len ? s[len - 1 - j] : 0);
+      k->str = s;
+      k->len = len;
+      k->target = patterns[i].target;
+    }
+  keys = iprtree_build_sort (keys);
+
+  /* Grow the pool once, to the final node count */
+  n_nodes = iprtree_build_count (keys);
+  n_free = pool_free_elts (container->nodes);
+  if (n_nodes > n_free)
+    pool_alloc (container->nodes, n_nodes - n_free);
+
+  vec_add2 (stack, b, 1);
+  b->ni = tree->iprtree_root_node_index;
+  b->start = b->sel = 0;
+  b->bitmap = 0;
+
+  vec_foreach (k, keys)
+    {
+      iprtree_build_prefetch (keys, k);
+      s = k->str;
+      len = k->len;
+      d = k->n_common;
+
+      /* The root wildcard is the default leaf of the root */
+      if (len == 0)
+	{
+	  iprtree_build_add_child (
+	    stack, IPRTREE_DEFAULT_CHILD,
+	    iprtree_allocate_leaf_node (container, k->target));
+	  continue;
+	}
+
+      if (ps && d == prev_len)
+	{
+	  /* The pattern before is a wildcard this one extends: its leaf
+	   * becomes the default of a node right after it */
+	  b = iprtree_build_push (container, &stack, d, d);
+	  iprtree_build_add_child (b, IPRTREE_DEFAULT_CHILD, child);
+	}
+      else if (ps)
+	{
+	  /* No later pattern reaches below d on the path of the one before */
+	  while (vec_end (stack)[-1].start > d)
+	    {
+	      b = vec_end (stack) - 1;
+	      iprtree_build_add_child (
+		b, iprtree_conversion[ps[prev_len - 1 - b->sel]], child);
+	      child = iprtree_build_emit (container, b, ps, prev_len);
+	      vec_dec_len (stack, 1);
+	    }
+
+	  /* Leaving inside the skip string: split it, the node keeps the
+	   * part after d and a new one takes the part before */
+	  b = vec_end (stack) - 1;
+	  if (d < b->sel)
 	    {
-	      nni = iprtree_allocate_internal_node_with_default_leaf (
-		container, IPRTREE_INVALID_INDEX);
-	      new_node = iprtree_node_at_index (container, nni);
-	      internal_node = iprtree_node_at_index (container, ini);
-
-	      new_node->n_skip =
-		clib_min (remain_len - 1, ARRAY_LEN (new_node->skip_str));
-	      clib_memcpy (new_node->skip_str,
-			   pattern + remain_len - new_node->n_skip,
-			   new_node->n_skip);
-	      remain_len -= new_node->n_skip;
-	      ASSERT (remain_len > 0);
-	      iprtree_internal_node_set_child (container, internal_node,
-					       last_char, nni);
-	      /* Don't need a ref to the new node */
-	      iprtree_free_node (container, nni);
-	      remain_len -= 1;
-	      last_char = pattern[remain_len];
-	      ini = nni;
-	      internal_node = new_node;
+	      lower = b[0];
+	      lower.start = d + 1;
+	      iprtree_build_add_child (
+		&lower, iprtree_conversion[ps[prev_len - 1 - lower.sel]],
+		child);
+	      child = iprtree_build_emit (container, &lower, ps, prev_len);
+	      b->ni = iprtree_allocate_internal_node (container);
+	      b->sel = d;
+	      b->bitmap = 0;
 	    }
-	  internal_node = iprtree_node_at_index (container, ini);
-	  iprtree_internal_node_set_child (container, internal_node, last_char,
-					   nli);
+	  iprtree_build_add_child (b, iprtree_conversion[ps[prev_len - 1 - d]],
+				   child);
 	}
-      iprtree_free_node (container, nli);
+
+      /* The rest of the pattern, cut in skip strings from where it left the
+       * one before */
+      child = iprtree_allocate_leaf_node (container, k->target);
+      for (uword c = d + 1; c < len; c = b->sel + 1)
+	b = iprtree_build_push (container, &stack, c,
+				iprtree_build_next_sel (c, len));
+      ps = s;
+      prev_len = len;
     }
+
+  if (ps)
+    {
+      while (vec_len (stack) > 1)
+	{
+	  b = vec_end (stack) - 1;
+	  iprtree_build_add_child (
+	    b, iprtree_conversion[ps[prev_len - 1 - b->sel]], child);
+	  child = iprtree_build_emit (container, b, ps, prev_len);
+	  vec_dec_len (stack, 1);
+	}
+      iprtree_build_add_child (stack, iprtree_conversion[ps[prev_len - 1]],
+			       child);
+    }
+  iprtree_build_emit (container, stack, ps, prev_len);
+  vec_free (stack);
+  vec_free (keys);
+  return rv;
+}
+
+/* Moves the children of the src_tree root, default leaf included, under the
+ * root of tree. Nodes and child arrays are copied into container with their
+ * indices relocated, then src is freed. The chars they use must be free under
+ * the destination root. */
+void
+iprtree_splice (iprtree_container_t *container, iprtree_t *tree,
+		iprtree_container_t *src, iprtree_t *src_tree)
+{
+  iprtree_node_index_t *map = 0, *slot;
+  iprtree_node_t *src_node, *node, *root;
+  u32 n_nodes = pool_elts (src->nodes);
+  u64 bits;
+  u8 class;
+
+  vec_validate_init_empty (map, pool_len (src->nodes) - 1,
+			   IPRTREE_INVALID_INDEX);
+  pool_alloc (container->nodes, n_nodes);
+  pool_foreach (src_node, src->nodes)
+    {
+      if (src_node - src->nodes == src_tree->iprtree_root_node_index)
+	continue;
+      pool_get (container->nodes, node);
+      node[0] = src_node[0];
+      map[src_node - src->nodes] = node - container->nodes;
+      if (node->type != IPRTREE_NODE_TYPE_INTERNAL)
+	continue;
+      node->n_skip = 0;
+      iprtree_node_set_skip_str (container, node,
+				 iprtree_node_skip_str (src, src_node),
+				 src_node->n_skip);
+    }
+
+  /* Now that every node has its new index, rebuild the child arrays */
+  for (u32 i = 0; i < vec_len (map); i++)
+    {
+      if (map[i] == IPRTREE_INVALID_INDEX)
+	continue;
+      src_node = iprtree_node_at_index (src, i);
+      node = iprtree_node_at_index (container, map[i]);
+      if (node->type != IPRTREE_NODE_TYPE_INTERNAL)
+	continue;
+      class = iprtree_children_class (count_set_bits (node->bitmap));
+      if (class != (u8) ~0)
+	node->children = iprtree_children_alloc (container, class);
+      for (bits = node->bitmap; bits; bits &= bits - 1)
+	{
+	  u8 c = count_trailing_zeros (bits);
+	  slot = iprtree_node_child_slot (container, node, c);
+	  slot[0] = map[iprtree_node_child (src, src_node, c)];
+	}
+    }
+
+  /* The source root references them once, so do we */
+  src_node = iprtree_node_at_index (src, src_tree->iprtree_root_node_index);
+  root = iprtree_node_at_index (container, tree->iprtree_root_node_index);
+  for (bits = src_node->bitmap; bits; bits &= bits - 1)
+    {
+      u8 c = count_trailing_zeros (bits);
+      ASSERT (!(root->bitmap & (1ULL << c)));
+      iprtree_internal_node_toggle_child (
+	container, root, c, map[iprtree_node_child (src, src_node, c)]);
+    }
+
+  vec_free (map);
+  iprtree_container_free (src);
+  src_tree->iprtree_root_node_index = IPRTREE_INVALID_INDEX;
+}
+
+void
+iprtree_container_free (iprtree_container_t *container)
+{
+  pool_free (container->nodes);
+  vec_free (container->children);
+  for (int i = 0; i < IPRTREE_CHILD_CLASSES; i++)
+    vec_free (container->free_children[i]);
+  vec_free (container->skip_strs);
+  for (int i = 0; i < IPRTREE_SKIP_CLASSES; i++)
+    vec_free (container->free_skip_strs[i]);
 }
 
 static clib_error_t *
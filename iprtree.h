@@ -23,29 +23,80 @@ typedef enum : u8
 typedef u32 iprtree_node_index_t;
 typedef u32 iprtree_leaf_index_t;
 
+/* Child arrays are carved from the container in power of 2 blocks of 1 to
+ * 64 slots */
+#define IPRTREE_CHILD_CLASSES 7
+
+/* Internal node layouts, picked by child count (popcount of the bitmap):
+ * - 1 child: the child index is stored inline in node->children
+ * - 2 to IPRTREE_SPARSE_MAX: dense array, indexed by popcount of lower bits
+ * - more: a 64 slot block indexed directly by the converted char
+ * Nodes move between layouts as children are added and removed. */
+#define IPRTREE_SPARSE_MAX 32
+
+/* Skip strings of up to IPRTREE_SKIP_INLINE chars are stored in the node.
+ * Longer ones, up to IPRTREE_SKIP_MAX, are stored in container->skip_strs in
+ * blocks rounded up to IPRTREE_SKIP_ALIGN chars, and the node keeps the first
+ * IPRTREE_SKIP_PREFIX chars a lookup compares. */
+#define IPRTREE_SKIP_INLINE  8
+#define IPRTREE_SKIP_PREFIX  4
+#define IPRTREE_SKIP_MAX     255
+#define IPRTREE_SKIP_ALIGN   8
+#define IPRTREE_SKIP_CLASSES ((IPRTREE_SKIP_MAX - 1) / IPRTREE_SKIP_ALIGN)
+
 typedef struct
 {
   iptree_node_type_t type;
-  u8 n_children;
   u8 n_skip;
-  u8 skip_str[6]; /* Not in reversed order, unconverted chars, only valid for
-		     internal nodes */
-  u32 ref_cnt;
+  u16 ref_cnt;
+  /* Not in reversed order, unconverted chars, only valid for internal
+   * nodes */
+  union
+  {
+    u8 skip_str[IPRTREE_SKIP_INLINE];
+    struct
+    {
+      /* Last chars of the skip string, the first ones consumed */
+      u8 skip_prefix[IPRTREE_SKIP_PREFIX];
+      u32 skip_offset;
+    };
+  };
   union
   {
     iprtree_leaf_index_t target;
-    iprtree_node_index_t by_prev_letter[IPRTREE_ARITY];
+    /* The only child, or the offset of the child array in
+     * container->children */
+    u32 children;
   };
+  u64 bitmap; /* Converted chars that have a child, internal nodes only */
 } iprtree_node_t;
 
+/* Pseudo char past the converted ones: its child is the default leaf of a
+ * wildcard pattern ending right after the node's skip string. Lookups that
+ * consumed the skip string fall back to it on a miss further down. */
+#define IPRTREE_DEFAULT_CHILD IPRTREE_ARITY
+
+STATIC_ASSERT (IPRTREE_DEFAULT_CHILD < 64, "iprtree bitmap is too small");
+
 typedef struct
 {
   iprtree_node_index_t iprtree_root_node_index;
 } iprtree_t;
 
+/* A prepared pattern and its leaf target, for iprtree_build() */
+typedef struct
+{
+  u8 *str;
+  iprtree_leaf_index_t target;
+} iprtree_pattern_t;
+
 typedef struct
 {
   iprtree_node_t *nodes;
+  iprtree_node_index_t *children;
+  u32 *free_children[IPRTREE_CHILD_CLASSES];
+  u8 *skip_strs;
+  u32 *free_skip_strs[IPRTREE_SKIP_CLASSES];
 } iprtree_container_t;
 
 extern u8 iprtree_conversion[];
@@ -58,6 +109,119 @@ iprtree_node_at_index (iprtree_container_t *container,
   return pool_elt_at_index (container->nodes, index);
 }
 
+/* Size class of the child array of n children, ~0 when stored inline */
+static_always_inline u8
+iprtree_children_class (u32 n)
+{
+  if (n <= 1)
+    return ~0;
+  if (n > IPRTREE_SPARSE_MAX)
+    return IPRTREE_CHILD_CLASSES - 1;
+  return max_log2 (n);
+}
+
+/* Slot holding the child of an internal node for a converted char, NULL if
+ * there is none */
+static_always_inline iprtree_node_index_t *
+iprtree_node_child_slot (iprtree_container_t *container, iprtree_node_t *node,
+			 u8 converted)
+{
+  u64 bit = 1ULL << converted;
+  u64 bitmap = node->bitmap;
+  if (!(bitmap & bit))
+    return NULL;
+  if (bitmap == bit)
+    return &node->children;
+  if (count_set_bits (bitmap) > IPRTREE_SPARSE_MAX)
+    return container->children + node->children + converted;
+  return container->children + node->children +
+	 count_set_bits (bitmap & (bit - 1));
+}
+
+static_always_inline iprtree_node_index_t
+iprtree_node_child (iprtree_container_t *container, iprtree_node_t *node,
+		    u8 converted)
+{
+  iprtree_node_index_t *slot =
+    iprtree_node_child_slot (container, node, converted);
+  return slot ? slot[0] : IPRTREE_INVALID_INDEX;
+}
+
+static_always_inline u32
+iprtree_children_alloc (iprtree_container_t *container, u8 log2_size)
+{
+  u32 offset;
+  if (vec_len (container->free_children[log2_size]))
+    return vec_pop (container->free_children[log2_size]);
+  offset = vec_len (container->children);
+  vec_resize (container->children, 1 << log2_size);
+  return offset;
+}
+
+static_always_inline void
+iprtree_children_free (iprtree_container_t *container, u32 offset,
+		       u8 log2_size)
+{
+  vec_add1 (container->free_children[log2_size], offset);
+}
+
+/* Size class of the arena block of a skip string longer than
+ * IPRTREE_SKIP_INLINE, the block holds (class + 2) * IPRTREE_SKIP_ALIGN
+ * chars */
+static_always_inline u8
+iprtree_skip_class (uword n)
+{
+  return (n - 1) / IPRTREE_SKIP_ALIGN - 1;
+}
+
+/* Skip string of an internal node, in the node or in the arena */
+static_always_inline u8 *
+iprtree_node_skip_str (iprtree_container_t *container, iprtree_node_t *node)
+{
+  if (node->n_skip <= IPRTREE_SKIP_INLINE)
+    return node->skip_str;
+  return container->skip_strs + node->skip_offset;
+}
+
+/* Stores a skip string of n chars in a node that holds none. str must not
+ * point into the arena, which can move. */
+static_always_inline void
+iprtree_node_set_skip_str (iprtree_container_t *container,
+			   iprtree_node_t *node, u8 *str, uword n)
+{
+  u8 class;
+
+  ASSERT (node->n_skip == 0 && n <= IPRTREE_SKIP_MAX);
+  node->n_skip = n;
+  if (n <= IPRTREE_SKIP_INLINE)
+    {
+      clib_memcpy (node->skip_str, str, n);
+      return;
+    }
+  class = iprtree_skip_class (n);
+  if (vec_len (container->free_skip_strs[class]))
+    node->skip_offset = vec_pop (container->free_skip_strs[class]);
+  else
+    {
+      node->skip_offset = vec_len (container->skip_strs);
+      vec_resize (container->skip_strs, (class + 2) * IPRTREE_SKIP_ALIGN);
+    }
+  clib_memcpy (container->skip_strs + node->skip_offset, str, n);
+  clib_memcpy (node->skip_prefix, str + n - IPRTREE_SKIP_PREFIX,
+	       IPRTREE_SKIP_PREFIX);
+}
+
+/* Gives back the arena block of the skip string of a node, if any */
+static_always_inline void
+iprtree_node_clear_skip_str (iprtree_container_t *container,
+			     iprtree_node_t *node)
+{
+  if (node->n_skip > IPRTREE_SKIP_INLINE)
+    vec_add1 (container->free_skip_strs[iprtree_skip_class (node->n_skip)],
+	      node->skip_offset);
+  node->n_skip = 0;
+}
+
 typedef struct
 {
   iprtree_node_index_t *current;
@@ -99,21 +263,17 @@ retry:
 
   /* if it's a node with children, keep going */
   if (current_node->type == IPRTREE_NODE_TYPE_INTERNAL &&
-      current_node->n_children)
+      current_node->bitmap)
     {
-      u8 found = 0;
-      for (u8 i = current_child_index + 1; i < IPRTREE_ARITY; i++)
-	{
-	  if (current_node->by_prev_letter[i] != IPRTREE_INVALID_INDEX)
-	    {
-	      next_node_index = current_node->by_prev_letter[i];
-	      current_child_index = i;
-	      found = 1;
-	      break;
-	    }
-	}
-      if (found)
+      /* Children left after the one we came back from, if any */
+      u64 remaining = current_node->bitmap;
+      if (current_child_index != (u8) ~0)
+	remaining &= ~((2ULL << current_child_index) - 1);
+      if (remaining)
 	{
+	  current_child_index = count_trailing_zeros (remaining);
+	  next_node_index =
+	    iprtree_node_child (container, current_node, current_child_index);
 	  /* Push node_index on iterator and current_sibling index*/
 	  vec_add1 (iterator->current, next_node_index);
 	  vec_add1 (iterator->sibling_index, current_child_index);
@@ -156,25 +316,47 @@ iprtree_iterator_get_current (iprtree_iterator_t *iterator)
        iprtree_iterator_advance (container, &(it)))
 
 static_always_inline iprtree_node_index_t
-iprtree_lookup_internal (iprtree_node_t *current_internal_node, u8 *str,
+iprtree_lookup_internal (iprtree_container_t *container,
+			 iprtree_node_t *current_internal_node, u8 *str,
 			 uword *remain_len, uword *remain_n_skip,
 			 u8 *internal_node_entirely_consumed,
 			 u8 *exhausted_str)
 {
   u8 converted_char;
   word char_index = *remain_len - 1;
-  *remain_n_skip = current_internal_node->n_skip;
-  u8 *to_skip = current_internal_node->skip_str + *remain_n_skip - 1;
+  uword n_skip = current_internal_node->n_skip, n_inline = n_skip;
+  u8 *to_skip = current_internal_node->skip_str + n_skip - 1;
   str = str + char_index;
   *internal_node_entirely_consumed = 0;
   *exhausted_str = 0;
-  while (*remain_len > 0 && *remain_n_skip > 0 && str[0] == to_skip[0])
+  /* Compare the chars kept in the node first, and only go to the arena for
+   * the rest of a long skip string when they all match */
+  if (n_skip > IPRTREE_SKIP_INLINE)
+    {
+      n_inline = IPRTREE_SKIP_PREFIX;
+      to_skip = current_internal_node->skip_prefix + IPRTREE_SKIP_PREFIX - 1;
+    }
+  *remain_n_skip = n_skip;
+  while (*remain_len > 0 && *remain_n_skip > n_skip - n_inline &&
+	 str[0] == to_skip[0])
     {
       *remain_len -= 1;
       *remain_n_skip -= 1;
       str -= 1;
       to_skip -= 1;
     }
+  if (*remain_n_skip == n_skip - n_inline && *remain_n_skip > 0)
+    {
+      to_skip = container->skip_strs + current_internal_node->skip_offset +
+		*remain_n_skip - 1;
+      while (*remain_len > 0 && *remain_n_skip > 0 && str[0] == to_skip[0])
+	{
+	  *remain_len -= 1;
+	  *remain_n_skip -= 1;
+	  str -= 1;
+	  to_skip -= 1;
+	}
+    }
 
   if (*remain_len == 0)
     *exhausted_str = 1;
@@ -194,7 +376,8 @@ iprtree_lookup_internal (iprtree_node_t *current_internal_node, u8 *str,
   if (converted_char == (u8) ~0)
     return IPRTREE_INVALID_INDEX;
 
-  return current_internal_node->by_prev_letter[converted_char];
+  return iprtree_node_child (container, current_internal_node,
+			     converted_char);
 }
 
 /**
@@ -212,19 +395,23 @@ iprtree_lookup_internal (iprtree_node_t *current_internal_node, u8 *str,
  * @param[out] last_internal last internal node index that was completely
  * consumed (i.e., skip str & valid child)
  * @param[out] target leaf index if the last valid node is a leaf
+ * @param[out] default_leaf default leaf of the deepest internal node whose
+ * skip string was consumed
  *
  */
 static_always_inline iprtree_node_index_t
 iprtree_consume_str (iprtree_container_t *container, iprtree_t *tree, u8 *str,
 		     uword *remain_len, uword *n_skip_in_node,
 		     iprtree_node_index_t *last_internal, u8 *exhausted_str,
-		     iprtree_leaf_index_t *target)
+		     iprtree_leaf_index_t *target,
+		     iprtree_node_index_t *default_leaf)
 {
   iprtree_node_index_t current = tree->iprtree_root_node_index;
   *last_internal = IPRTREE_INVALID_INDEX;
   iprtree_node_t *internal_node;
   iprtree_node_index_t tmp;
   *target = IPRTREE_INVALID_INDEX;
+  *default_leaf = IPRTREE_INVALID_INDEX;
   *last_internal = current;
   u8 internal_node_entirely_consumed;
 
@@ -241,8 +428,12 @@ iprtree_consume_str (iprtree_container_t *container, iprtree_t *tree, u8 *str,
 	  break;
 	}
       tmp = iprtree_lookup_internal (
-	internal_node, str, remain_len, n_skip_in_node,
+	container, internal_node, str, remain_len, n_skip_in_node,
 	&internal_node_entirely_consumed, exhausted_str);
+      if (internal_node_entirely_consumed &&
+	  (internal_node->bitmap & (1ULL << IPRTREE_DEFAULT_CHILD)))
+	*default_leaf = iprtree_node_child (container, internal_node,
+					    IPRTREE_DEFAULT_CHILD);
       /* if the internal node was entirely consumed, the failed node is the
        * child of internal_node */
       if (tmp == IPRTREE_INVALID_INDEX && internal_node_entirely_consumed)
@@ -266,12 +457,16 @@ iprtree_lookup (iprtree_container_t *container, iprtree_t *tree, u8 *str,
 		uword len)
 {
   iprtree_leaf_index_t target;
+  iprtree_node_index_t default_leaf;
   __clib_unused iprtree_node_index_t result;
   __clib_unused iprtree_node_index_t last_internal;
   __clib_unused u8 exhausted_str;
   uword n_skip_in_node;
-      result = iprtree_consume_str (container, tree, str, &len, &n_skip_in_node,
-				&last_internal, &exhausted_str, &target);
+  result = iprtree_consume_str (container, tree, str, &len, &n_skip_in_node,
+				&last_internal, &exhausted_str, &target,
+				&default_leaf);
+  if (target == IPRTREE_INVALID_INDEX && default_leaf != IPRTREE_INVALID_INDEX)
+    target = iprtree_node_at_index (container, default_leaf)->target;
   return target;
 }
 
@@ -290,33 +485,6 @@ iprtree_node_ref_inc (iprtree_node_t *node)
   node->ref_cnt += 1;
 }
 
-static_always_inline iprtree_node_index_t
-iprtree_allocate_internal_node_with_default_leaf (
-  iprtree_container_t *container, iprtree_node_index_t default_child)
-{
-  /* TODO: refactor ifs... */
-  iprtree_node_index_t ni = iprtree_allocate_node (container);
-  iprtree_node_t *node = iprtree_node_at_index (container, ni);
-  iprtree_node_t *leaf;
-  node->ref_cnt = 1;
-
-  if (default_child != IPRTREE_INVALID_INDEX)
-    leaf = iprtree_node_at_index (container, default_child);
-
-  node->type = IPRTREE_NODE_TYPE_INTERNAL;
-  for (int i = 0; i < IPRTREE_ARITY; i++)
-    {
-      node->by_prev_letter[i] = default_child;
-      if (default_child != IPRTREE_INVALID_INDEX)
-	{
-	  iprtree_node_ref_inc (leaf);
-	  node->n_children += 1;
-	}
-    }
-
-  return ni;
-}
-
 static_always_inline iprtree_node_index_t
 iprtree_allocate_internal_node (iprtree_container_t *container)
 {
@@ -324,10 +492,7 @@ iprtree_allocate_internal_node (iprtree_container_t *container)
   iprtree_node_t *node = iprtree_node_at_index (container, ni);
   node->ref_cnt = 1;
   node->type = IPRTREE_NODE_TYPE_INTERNAL;
-  for (int i = 0; i < IPRTREE_ARITY; i++)
-    {
-      node->by_prev_letter[i] = IPRTREE_INVALID_INDEX;
-    }
+  node->children = IPRTREE_INVALID_INDEX;
 
   return ni;
 }
@@ -351,7 +516,14 @@ iprtree_free_node (iprtree_container_t *container, iprtree_node_index_t ni)
   ASSERT (node->ref_cnt > 0);
   node->ref_cnt -= 1;
   if (node->ref_cnt == 0)
-    pool_put_index (container->nodes, ni);
+    {
+      u8 class = iprtree_children_class (count_set_bits (node->bitmap));
+      if (node->type == IPRTREE_NODE_TYPE_INTERNAL && class != (u8) ~0)
+	iprtree_children_free (container, node->children, class);
+      if (node->type == IPRTREE_NODE_TYPE_INTERNAL)
+	iprtree_node_clear_skip_str (container, node);
+      pool_put_index (container->nodes, ni);
+    }
 }
 
 static_always_inline void
@@ -367,7 +539,15 @@ memcpy_reverse (void *dst, void *src, uword len)
     }
 }
 void iprtree_clear (iprtree_container_t *container, iprtree_t *tree);
-void iprtree_insert_pattern (iprtree_container_t *container, iprtree_t *tree,
-			     u8 *pattern, iprtree_leaf_index_t target);
+uword iprtree_memory_size (iprtree_container_t *container);
+int iprtree_insert_pattern (iprtree_container_t *container, iprtree_t *tree,
+			    u8 *pattern, iprtree_leaf_index_t target);
+int iprtree_build (iprtree_container_t *container, iprtree_t *tree,
+		   iprtree_pattern_t *patterns);
+int iprtree_delete_pattern (iprtree_container_t *container, iprtree_t *tree,
+			    u8 *pattern);
+void iprtree_splice (iprtree_container_t *container, iprtree_t *tree,
+		     iprtree_container_t *src, iprtree_t *src_tree);
+void iprtree_container_free (iprtree_container_t *container);
 
 #endif /* included_iprtree_h */
@@ -1,5 +1,9 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include "domain_iprtree.h"
 #include "domain_trie.h"
@@ -12,73 +16,792 @@
 #define label_max 63
 #define label_count 4
 
-int count_kvs(BVT(clib_bihash_kv) *kv, void *args)
+/*
+ * Allocation accounting for check_search_allocations(): the definitions
+ * below interpose the libc and vppinfra heap entry points.
+ */
+static int count_allocs;
+static u64 n_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size)
+{
+    n_allocs += count_allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
 {
-    u64 *a = args;
-    u32 *idxs = (u32 *)kv->value;
-    u32 *idx = 0;
-    vec_foreach(idx, idxs) {
-        ++*a;
+    n_allocs += count_allocs;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+    n_allocs += count_allocs;
+    return __libc_realloc(p, size);
+}
+
+void *clib_mem_heap_alloc_aligned(void *heap, uword size, uword align)
+{
+    static void *(*real)(void *, uword, uword);
+    if (!real)
+        real = dlsym(RTLD_NEXT, "clib_mem_heap_alloc_aligned");
+    n_allocs += count_allocs;
+    return real(heap, size, align);
+}
+
+void *clib_mem_heap_realloc_aligned(void *heap, void *p, uword size, uword align)
+{
+    static void *(*real)(void *, void *, uword, uword);
+    if (!real)
+        real = dlsym(RTLD_NEXT, "clib_mem_heap_realloc_aligned");
+    n_allocs += count_allocs;
+    return real(heap, p, size, align);
+}
+
+void check_search_allocations(domain_trie_t *dt, char *domains)
+{
+    n_allocs = 0;
+    count_allocs = 1;
+    for (int i = 0; i < count * max_len; i += max_len) {
+        u64 backendsets = domain_trie_search(dt, &domains[i]);
+        assert(backendsets == (i / max_len));
     }
+    count_allocs = 0;
 
-    return 1;
+    fformat(stderr, "heap allocations during %llu searches: %llu\n", count, n_allocs);
+    assert(n_allocs == 0);
 }
 
-u64 count_kv_table(BVT(clib_bihash) *ht)
+/*
+ * Delete and re-insert every pattern a few times: the trie must go back to
+ * the bare root in between and never grow past its first build.
+ */
+void check_delete_churn(domain_trie_t *dt, char *domains)
 {
-    u64 a = 0;
+    uword n_nodes = pool_len(dt->nodes);
+    uword n_labels = pool_len(dt->dict->pool_labels);
 
-    BV(clib_bihash_foreach_key_value_pair)(ht, count_kvs, (void *)&a);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < count * max_len; i += max_len) {
+            int rc = domain_trie_delete(dt, &domains[i]);
+            assert(rc == 0);
+        }
 
-    return a;
+        assert(pool_elts(dt->nodes) == 1);
+        assert(pool_elts(dt->dict->pool_labels) == 0);
+        assert(domain_trie_search(dt, &domains[0]) == DOMAIN_TRIE_NO_MATCH);
+        assert(domain_trie_delete(dt, &domains[0]) < 0);
+
+        for (int i = 0; i < count * max_len; i += max_len) {
+            int rc = domain_trie_insert(dt, &domains[i], i / max_len);
+            assert(rc == 0);
+        }
+
+        assert(pool_len(dt->nodes) == n_nodes);
+        assert(pool_len(dt->dict->pool_labels) == n_labels);
+    }
+
+    fformat(stderr, "delete churn: %llu nodes, %llu labels\n", n_nodes, n_labels);
 }
 
-int dump_labels_kv(BVT(clib_bihash_kv) *kv, void *args)
+f64 time_now()
 {
-    domain_trie_t *dt = args;
-    u32 *idxs = (u32 *)kv->value;
-    u32 *idx = 0;
-    vec_foreach(idx, idxs) {
-        hash_value_t *value = &dt->pool_labels[*idx];
-        fformat(stderr, "%llu %v %llu", kv->key, value->data, value->counter);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Scalar loop against domain_trie_search_batch() at several batch sizes */
+void bench_search_batch(domain_trie_t *dt, char *domains)
+{
+    static const u32 batch_sizes[] = { 1, 4, 8, 16, 256 };
+    const u8 *batch[256];
+    uword lens[256];
+    u64 results[256];
+
+    f64 start = time_now();
+    for (int i = 0; i < count * max_len; i += max_len) {
+        u64 backendsets = domain_trie_search(dt, &domains[i]);
+        assert(backendsets == (i / max_len));
+    }
+    fformat(stderr, "scalar search: %.1f ns/lookup\n", (time_now() - start) * 1e9 / count);
+
+    for (int b = 0; b < ARRAY_LEN(batch_sizes); b++) {
+        u32 batch_size = batch_sizes[b];
+
+        start = time_now();
+        for (u32 first = 0; first < count; first += batch_size) {
+            u32 n = clib_min(batch_size, count - first);
+            for (u32 j = 0; j < n; j++) {
+                batch[j] = (const u8 *)&domains[(first + j) * max_len];
+                lens[j] = strnlen((const char *)batch[j], max_len);
+            }
+
+            domain_trie_search_batch(dt, batch, lens, n, results);
+
+            for (u32 j = 0; j < n; j++)
+                assert(results[j] == first + j);
+        }
+        fformat(stderr, "batch %u search: %.1f ns/lookup\n", batch_size,
+                (time_now() - start) * 1e9 / count);
     }
-    fformat(stderr, "\n\n");
-    return 1;
 }
 
-void dump_labels_table(domain_trie_t *dt)
+#define DEEP_PATTERNS 200000
+
+/*
+ * Lookup latency on 4-, 8- and 16-label domains, level by level against
+ * domain_trie_search_pipelined(). Each lookup picks its domain from the
+ * result of the one before, so lookups cannot overlap and the time is the
+ * latency of one.
+ */
+void bench_search_pipelined(void)
+{
+    static const u32 depths[] = { 4, 8, 16 };
+    const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    char *deep = calloc(DEEP_PATTERNS, max_len);
+
+    for (int d = 0; d < ARRAY_LEN(depths); d++) {
+        domain_trie_t dt;
+        f64 ns[2];
+
+        domain_trie_init(&dt);
+        for (u32 i = 0; i < DEEP_PATTERNS; i++) {
+            char *domain = &deep[i * max_len];
+            int pos = 0;
+            for (u32 l = 0; l < depths[d]; l++) {
+                int label_len = label_min + rand() % 8;
+                for (int j = 0; j < label_len; j++)
+                    domain[pos++] = charset[rand() % (sizeof(charset) - 1)];
+                domain[pos++] = l < depths[d] - 1 ? '.' : '\0';
+            }
+            assert(domain_trie_insert(&dt, domain, i) == 0);
+        }
+
+        for (int p = 0; p < 2; p++) {
+            u64 pick = 0;
+            f64 start = time_now();
+            for (u32 i = 0; i < DEEP_PATTERNS; i++) {
+                const u8 *domain = (const u8 *)&deep[pick * max_len];
+                uword len = strnlen((const char *)domain, max_len);
+                u64 backendsets =
+                    p ? domain_trie_search_pipelined(&dt, domain, len) : domain_trie_search_len(&dt, domain, len);
+                assert(backendsets == pick);
+                pick = (backendsets * 2654435761ULL + i) % DEEP_PATTERNS;
+            }
+            ns[p] = (time_now() - start) * 1e9 / DEEP_PATTERNS;
+        }
+        fformat(stderr, "%u labels: %.1f ns/lookup, %.1f pipelined\n", depths[d], ns[0], ns[1]);
+
+        domain_trie_free(&dt);
+    }
+
+    free(deep);
+}
+
+/* Live lookups against the same patterns in a domain_trie_freeze() image */
+void bench_search_frozen(domain_trie_t *dt, char *domains)
 {
-    BV(clib_bihash_foreach_key_value_pair)(&dt->labels, dump_labels_kv, (void *)dt);
+    f64 start = time_now();
+    domain_trie_frozen_t *ft = domain_trie_freeze(dt);
+    fformat(stderr, "freeze: %.3f sec, image: %llu KB\n", time_now() - start, ft->size >> 10);
+
+    start = time_now();
+    for (int i = 0; i < count * max_len; i += max_len) {
+        u64 backendsets = domain_trie_search(dt, &domains[i]);
+        assert(backendsets == (i / max_len));
+    }
+    fformat(stderr, "live search: %.1f ns/lookup\n", (time_now() - start) * 1e9 / count);
+
+    start = time_now();
+    for (int i = 0; i < count * max_len; i += max_len) {
+        const u8 *domain = (const u8 *)&domains[i];
+        u64 backendsets = domain_trie_search_frozen(ft, domain, strnlen((const char *)domain, max_len));
+        assert(backendsets == (i / max_len));
+    }
+    fformat(stderr, "frozen search: %.1f ns/lookup\n", (time_now() - start) * 1e9 / count);
+
+    domain_trie_frozen_free(ft);
 }
 
-int dump_back_kv(BVT(clib_bihash_kv) *kv, void *args)
+/* Write every pattern to data.txt and load it back with domain_trie_load_file() */
+void bench_load_file(char *domains)
+{
+    domain_trie_t dt;
+    FILE *file = fopen("data.txt", "w");
+
+    assert(file != NULL);
+    for (int i = 0; i < count * max_len; i += max_len)
+        fprintf(file, "%s %d\n", &domains[i], i / max_len);
+    fclose(file);
+
+    f64 start = time_now();
+    int n = domain_trie_load_file(&dt, "data.txt");
+    fformat(stderr, "loading %llu patterns from file: %.3f sec\n", count, time_now() - start);
+    assert(n == count);
+
+    for (int i = 0; i < count * max_len; i += max_len) {
+        u64 backendsets = domain_trie_search(&dt, &domains[i]);
+        assert(backendsets == (i / max_len));
+    }
+
+    domain_trie_free(&dt);
+
+    /* A pattern insert rejects, or a backendset past NO_MATCH, fails the load */
+    static const char *bad_lines[] = { "a.*b.com 1\n", "a..com 1\n", "a.com 18446744073709551615\n",
+                                       "a.com 99999999999999999999\n" };
+    for (int i = 0; i < ARRAY_LEN(bad_lines); i++) {
+        assert((file = fopen("data.txt", "w")) != NULL);
+        fprintf(file, "%s 1\n%s", &domains[0], bad_lines[i]);
+        fclose(file);
+        assert(domain_trie_load_file(&dt, "data.txt") == -1);
+    }
+    unlink("data.txt");
+}
+
+#define JOURNAL_PATH "trie.journal"
+
+static uword file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+/*
+ * Journal every pattern, checkpoint, journal a tail of changes on top and
+ * restart from the two files, torn last record included, against the
+ * time the inserts took in the first place.
+ */
+void bench_journal_restart(char *domains)
+{
+    domain_trie_t dt;
+
+    unlink(JOURNAL_PATH);
+    unlink(JOURNAL_PATH ".checkpoint");
+    assert(domain_trie_journal_open(&dt, JOURNAL_PATH, 0) == 0);
+
+    f64 start = time_now();
+    for (u32 i = 0; i < count; i++)
+        assert(domain_trie_insert(&dt, &domains[i * max_len], i) == 0);
+    f64 insert = time_now() - start;
+
+    start = time_now();
+    assert(domain_trie_checkpoint(&dt) == 0);
+    f64 checkpoint = time_now() - start;
+
+    /* Every tenth pattern moves to a new backendset, one is deleted */
+    for (u32 i = 0; i < count; i += 10)
+        assert(domain_trie_insert(&dt, &domains[i * max_len], count + i) == 0);
+    assert(domain_trie_delete(&dt, &domains[(count - 1) * max_len]) == 0);
+    domain_trie_free(&dt);
+
+    FILE *file = fopen(JOURNAL_PATH, "a");
+    fwrite("torn", 1, 4, file);
+    fclose(file);
+
+    uword bytes = file_size(JOURNAL_PATH) + file_size(JOURNAL_PATH ".checkpoint");
+    start = time_now();
+    assert(domain_trie_journal_open(&dt, JOURNAL_PATH, 0) == 0);
+    f64 restart = time_now() - start;
+    fformat(stderr, "journaled inserts: %.3f sec, checkpoint: %.3f sec, restart from %llu MB: %.3f sec, %.0f MB/s\n",
+            insert, checkpoint, bytes >> 20, restart, (bytes >> 20) / restart);
+
+    for (u32 i = 0; i < count - 1; i++)
+        assert(domain_trie_search(&dt, &domains[i * max_len]) == (i % 10 ? i : count + i));
+    assert(domain_trie_search(&dt, &domains[(count - 1) * max_len]) == DOMAIN_TRIE_NO_MATCH);
+
+    /* The torn record is cut off, so what comes after it is kept */
+    assert(domain_trie_insert(&dt, &domains[(count - 1) * max_len], count - 1) == 0);
+    domain_trie_free(&dt);
+    assert(domain_trie_journal_open(&dt, JOURNAL_PATH, 0) == 0);
+    assert(domain_trie_search(&dt, &domains[(count - 1) * max_len]) == count - 1);
+    domain_trie_free(&dt);
+
+    unlink(JOURNAL_PATH);
+    unlink(JOURNAL_PATH ".checkpoint");
+}
+
+/*
+ * A record that cannot be written, once for an insert and once for a
+ * delete: the change is not made, later ones fail until a checkpoint
+ * starts a new journal, and a restart finds what went in.
+ */
+void check_journal_append_failure(char *domains)
+{
+    const char *a = &domains[0], *b = &domains[max_len];
+    domain_trie_t dt;
+
+    unlink(JOURNAL_PATH);
+    unlink(JOURNAL_PATH ".checkpoint");
+    assert(domain_trie_journal_open(&dt, JOURNAL_PATH, 0) == 0);
+    assert(domain_trie_insert(&dt, a, 1) == 0);
+
+    close(dt.journal->fd);
+    assert(domain_trie_insert(&dt, b, 2) < 0);
+    assert(domain_trie_search(&dt, b) == DOMAIN_TRIE_NO_MATCH);
+    assert(dt.journal != NULL && dt.journal->fd < 0);
+    assert(domain_trie_delete(&dt, a) < 0);
+    assert(domain_trie_search(&dt, a) == 1);
+
+    assert(domain_trie_checkpoint(&dt) == 0);
+    assert(domain_trie_insert(&dt, b, 2) == 0);
+
+    close(dt.journal->fd);
+    assert(domain_trie_delete(&dt, a) < 0);
+    assert(domain_trie_search(&dt, a) == 1);
+    assert(domain_trie_insert(&dt, a, 3) < 0);
+    assert(domain_trie_search(&dt, a) == 1);
+    domain_trie_free(&dt);
+
+    assert(domain_trie_journal_open(&dt, JOURNAL_PATH, 0) == 0);
+    assert(domain_trie_search(&dt, a) == 1);
+    assert(domain_trie_search(&dt, b) == 2);
+    domain_trie_free(&dt);
+
+    unlink(JOURNAL_PATH);
+    unlink(JOURNAL_PATH ".checkpoint");
+}
+
+#define JUNK_LEN 6
+
+static f64 search_mix(domain_trie_t *dt, char *queries, u64 *expected, u32 n)
+{
+    f64 start = time_now();
+    for (u32 i = 0; i < n; i++) {
+        u64 backendsets = domain_trie_search(dt, &queries[i * (max_len + JUNK_LEN + 1)]);
+        assert(backendsets == expected[i]);
+    }
+    return (time_now() - start) * 1e9 / n;
+}
+
+/*
+ * A random-subdomain flood: some share of the lookups put a random label in
+ * front of a known domain, which walks the trie all the way down only to
+ * miss on the last label. Compare every mix with and without the filter.
+ */
+void bench_junk_filter(domain_trie_t *dt, char *domains)
+{
+    static const u32 junk_percent[] = { 0, 50, 90, 99 };
+    const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    u32 stride = max_len + JUNK_LEN + 1;
+    char *queries = calloc(count, stride);
+    u64 *expected = calloc(count, sizeof(u64));
+    f64 plain[ARRAY_LEN(junk_percent)];
+
+    assert(dt->dict->filter == NULL);
+    for (int f = 0; f < 2; f++) {
+        for (int m = 0; m < ARRAY_LEN(junk_percent); m++) {
+            for (u32 i = 0; i < count; i++) {
+                char *q = &queries[i * stride];
+
+                if (rand() % 100 < junk_percent[m]) {
+                    for (int j = 0; j < JUNK_LEN; j++)
+                        q[j] = charset[rand() % (sizeof(charset) - 1)];
+                    q[JUNK_LEN] = '.';
+                    strcpy(q + JUNK_LEN + 1, &domains[i * max_len]);
+                    expected[i] = DOMAIN_TRIE_NO_MATCH;
+                } else {
+                    strcpy(q, &domains[i * max_len]);
+                    expected[i] = i;
+                }
+            }
+
+            if (f == 0)
+                plain[m] = search_mix(dt, queries, expected, count);
+            else
+                fformat(stderr, "%u%% junk: %.1f ns/lookup, %.1f with filter\n", junk_percent[m],
+                        plain[m], search_mix(dt, queries, expected, count));
+        }
+
+        if (f == 0) {
+            f64 start = time_now();
+            domain_trie_enable_filter(dt);
+            fformat(stderr, "filter: %.3f sec, %llu KB\n", time_now() - start, vec_len(dt->dict->filter) >> 7);
+        }
+    }
+
+    free(queries);
+    free(expected);
+}
+
+#define TENANTS 8
+
+/*
+ * Tenants holding mostly the same patterns on one label dictionary: it
+ * should hold each label once, not once per tenant, and give every label
+ * back when the last tenant using it goes.
+ */
+void check_shared_dict(char *domains)
+{
+    domain_trie_t tenants[TENANTS];
+    domain_trie_stats_t stats;
+    u32 n = clib_min(count, 10000);
+    domain_trie_dict_t *d = domain_trie_dict_create(n * DOMAIN_TRIE_LABELS_PER_PATTERN, 0, 0);
+    char own[32];
+
+    for (int t = 0; t < TENANTS; t++) {
+        domain_trie_init_shared(&tenants[t], d, n + 1, 0);
+        for (u32 i = 0; i < n; i++)
+            assert(domain_trie_insert(&tenants[t], &domains[i * max_len], i) == 0);
+        snprintf(own, sizeof(own), "tenant%d.example.com", t);
+        assert(domain_trie_insert(&tenants[t], own, t) == 0);
+    }
+    uword n_labels = pool_elts(d->pool_labels);
+
+    domain_trie_stats(&tenants[0], &stats);
+    fformat(stderr, "%u tenants of %u patterns: %llu labels, dictionary %llu KB, tries %llu KB each\n",
+            TENANTS, n + 1, n_labels, stats.dict_bytes >> 10, (stats.total_bytes - stats.dict_bytes) >> 10);
+
+    for (int t = 0; t < TENANTS; t++) {
+        snprintf(own, sizeof(own), "tenant%d.example.com", t);
+        assert(domain_trie_search(&tenants[t], own) == t);
+        assert(domain_trie_search(&tenants[t], &domains[(n - 1) * max_len]) == n - 1);
+    }
+
+    /* Each tenant's own label goes with it, the shared ones with the last */
+    domain_trie_free(&tenants[0]);
+    assert(pool_elts(d->pool_labels) == n_labels - 1);
+    for (int t = 1; t < TENANTS; t++)
+        domain_trie_free(&tenants[t]);
+    assert(pool_elts(d->pool_labels) == 0);
+    domain_trie_dict_unref(d);
+}
+
+#define HOT_DOMAINS 4096
+#define HOT_PERCENT 90
+
+/*
+ * Skewed traffic, most lookups going to a few thousand names, with and
+ * without a domain_cache_t in front, then check a change to the trie is
+ * seen through the cache right away.
+ */
+void bench_search_cache(domain_trie_t *dt, char *domains)
+{
+    u32 *picks = calloc(count, sizeof(u32));
+    u32 n_hot = clib_min(count, HOT_DOMAINS);
+    domain_cache_t cache;
+
+    for (u32 i = 0; i < count; i++)
+        picks[i] = rand() % 100 < HOT_PERCENT ? rand() % n_hot : rand() % count;
+
+    f64 start = time_now();
+    for (u32 i = 0; i < count; i++)
+        assert(domain_trie_search(dt, &domains[picks[i] * max_len]) == picks[i]);
+    fformat(stderr, "skewed search: %.1f ns/lookup\n", (time_now() - start) * 1e9 / count);
+
+    domain_cache_init(&cache, DOMAIN_CACHE_LOG2_SETS);
+    start = time_now();
+    for (u32 i = 0; i < count; i++)
+        assert(domain_trie_search_cached(dt, &cache, &domains[picks[i] * max_len]) == picks[i]);
+    fformat(stderr, "cached skewed search: %.1f ns/lookup, %U\n", (time_now() - start) * 1e9 / count,
+            format_domain_cache, &cache);
+
+    assert(domain_trie_search_cached(dt, &cache, domains) == 0);
+    assert(domain_trie_delete(dt, domains) == 0);
+    assert(domain_trie_search_cached(dt, &cache, domains) == DOMAIN_TRIE_NO_MATCH);
+    assert(domain_trie_insert(dt, domains, 0) == 0);
+    assert(domain_trie_search_cached(dt, &cache, domains) == 0);
+
+    domain_cache_free(&cache);
+    free(picks);
+}
+
+#define HASH_BATCH 65536
+#define HASH_LABEL_MAX 16
+#define COLLIDING_LEN 52
+#define COLLIDING_LOG2 20
+#define COLLIDING_LOOKUPS 4096
+
+static const char *label_hash_names[] = { "crc32c", "crc32c pair", "fast64" };
+
+/*
+ * Equal-length labels over {a, c} differ in one bit per byte, and crc32c is
+ * linear in those bits: every combination of flips crc32c maps to zero
+ * leaves it unchanged. Find a basis of such combinations by elimination.
+ */
+static u32 colliding_basis(u64 *basis)
+{
+    u8 base[COLLIDING_LEN], flip[COLLIDING_LEN];
+    u32 pivot_crc[32];
+    u64 pivot_mask[32];
+    u32 n = 0;
+
+    clib_memset(base, 'a', COLLIDING_LEN);
+    clib_memset(pivot_crc, 0, sizeof(pivot_crc));
+    u32 crc = clib_crc32c(base, COLLIDING_LEN);
+
+    for (u32 j = 0; j < COLLIDING_LEN; j++) {
+        clib_memcpy(flip, base, COLLIDING_LEN);
+        flip[j] = 'c';
+        u32 v = clib_crc32c(flip, COLLIDING_LEN) ^ crc;
+        u64 m = 1ULL << j;
+
+        for (int b = 31; b >= 0 && v; b--) {
+            if (!(v & (1U << b)))
+                continue;
+            if (!pivot_crc[b]) {
+                pivot_crc[b] = v;
+                pivot_mask[b] = m;
+                break;
+            }
+            v ^= pivot_crc[b];
+            m ^= pivot_mask[b];
+        }
+        if (v == 0)
+            basis[n++] = m;
+    }
+    return n;
+}
+
+/* Label i of a key set, set 0 random but distinct, set 1 all one crc32c */
+static u32 key_set_label(u32 set, u32 i, const u64 *basis, u8 *label)
+{
+    const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+
+    if (set == 1) {
+        u64 x = 0;
+        for (u32 b = 0; b < COLLIDING_LOG2; b++)
+            if (i & (1 << b))
+                x ^= basis[b];
+        for (u32 j = 0; j < COLLIDING_LEN; j++)
+            label[j] = x & (1ULL << j) ? 'c' : 'a';
+        return COLLIDING_LEN;
+    }
+
+    u32 len = 5 + rand() % (HASH_LABEL_MAX - 5);
+    for (u32 j = 0; j < 5; j++, i /= 36)
+        label[j] = charset[i % 36];
+    for (u32 j = 5; j < len; j++)
+        label[j] = charset[rand() % 36];
+    return len;
+}
+
+/* One loop per hash, so each is inlined the way the trie would use it */
+static void hash_labels(u32 kind, const u8 *labels, const u8 *lens, u32 n, u64 *out)
+{
+    switch (kind) {
+    case 0:
+        for (u32 i = 0; i < n; i++)
+            out[i] = domain_label_hash_crc32c(labels + i * COLLIDING_LEN, lens[i]);
+        break;
+    case 1:
+        for (u32 i = 0; i < n; i++)
+            out[i] = domain_label_hash_crc32c_pair(labels + i * COLLIDING_LEN, lens[i]);
+        break;
+    default:
+        for (u32 i = 0; i < n; i++)
+            out[i] = domain_label_hash_fast64(labels + i * COLLIDING_LEN, lens[i]);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Label hash lookups against a trie of n one-label patterns from a key set */
+static f64 label_lookup_ns(u32 set, u32 n, const u64 *basis)
+{
+    domain_trie_t dt;
+    char *keys = calloc(n, COLLIDING_LEN + 1);
+
+    domain_trie_init(&dt);
+    for (u32 i = 0; i < n; i++) {
+        key_set_label(set, i, basis, (u8 *)&keys[i * (COLLIDING_LEN + 1)]);
+        assert(domain_trie_insert(&dt, &keys[i * (COLLIDING_LEN + 1)], i) == 0);
+    }
+
+    f64 start = time_now();
+    for (u32 i = 0; i < n; i++)
+        assert(domain_trie_search(&dt, &keys[i * (COLLIDING_LEN + 1)]) == i);
+    f64 ns = (time_now() - start) * 1e9 / n;
+
+    domain_trie_free(&dt);
+    free(keys);
+    return ns;
+}
+
+/*
+ * Every label hash over 1M and 10M distinct labels and over 1M labels
+ * sharing one crc32c: time per hash and the collision chains a label hash
+ * table would hold. Lookup times are for the hash the trie is built with.
+ */
+void bench_label_hash(void)
+{
+    static const struct {
+        char *name;
+        u32 set;
+        u32 n;
+    } key_sets[] = {
+        { "1M random", 0, 1000000 },
+        { "10M random", 0, 10000000 },
+        { "1M colliding", 1, 1 << COLLIDING_LOG2 },
+    };
+    u64 basis[COLLIDING_LEN];
+    u8 *labels = malloc(HASH_BATCH * COLLIDING_LEN);
+    u8 *lens = malloc(HASH_BATCH);
+
+    assert(colliding_basis(basis) >= COLLIDING_LOG2);
+
+    for (int k = 0; k < ARRAY_LEN(key_sets); k++) {
+        u32 n = key_sets[k].n;
+        u64 *hashes = malloc((uword)n * sizeof(u64));
+
+        for (u32 h = 0; h < ARRAY_LEN(label_hash_names); h++) {
+            uword chains[DOMAIN_TRIE_STATS_HIST] = { 0 };
+            uword max_chain = 0;
+            f64 elapsed = 0;
+
+            for (u32 first = 0; first < n; first += HASH_BATCH) {
+                u32 batch = clib_min(n - first, HASH_BATCH);
+                for (u32 i = 0; i < batch; i++)
+                    lens[i] = key_set_label(key_sets[k].set, first + i, basis, labels + i * COLLIDING_LEN);
+                f64 start = time_now();
+                hash_labels(h, labels, lens, batch, hashes + first);
+                elapsed += time_now() - start;
+            }
+
+            qsort(hashes, n, sizeof(u64), cmp_u64);
+            for (uword i = 0, j; i < n; i = j) {
+                for (j = i + 1; j < n && hashes[j] == hashes[i]; j++)
+                    ;
+                chains[clib_min(j - i, DOMAIN_TRIE_STATS_HIST) - 1]++;
+                max_chain = clib_max(max_chain, j - i);
+            }
+
+            fformat(stderr, "%s, %s: %.1f ns/hash, longest chain %llu, chains", key_sets[k].name,
+                    label_hash_names[h], elapsed * 1e9 / n, max_chain);
+            for (u32 i = 0; i < DOMAIN_TRIE_STATS_HIST; i++)
+                fformat(stderr, " %u%s:%llu", i + 1, i == DOMAIN_TRIE_STATS_HIST - 1 ? "+" : "", chains[i]);
+            fformat(stderr, "\n");
+        }
+        free(hashes);
+    }
+
+    fformat(stderr, "%s label lookups: %.1f ns random, %.1f ns colliding\n", DOMAIN_LABEL_HASH_NAME,
+            label_lookup_ns(0, count, basis), label_lookup_ns(1, COLLIDING_LOOKUPS, basis));
+
+    free(labels);
+    free(lens);
+}
+
+#define STRESS_READERS 4
+#define STRESS_SECONDS 2
+
+typedef struct {
+    domain_trie_t *dt;
+    char *domains;
+    u32 n_patterns;
+    volatile int *stop;
+    pthread_t thread;
+    u64 lookups;
+} stress_reader_t;
+
+static void *stress_reader(void *arg)
+{
+    stress_reader_t *r = arg;
+    u32 reader = domain_trie_reader_register(r->dt);
+    unsigned int seed = reader + 1;
+
+    assert(reader != ~0U);
+    while (!*r->stop) {
+        domain_trie_read_lock(r->dt, reader);
+        for (int j = 0; j < 64; j++) {
+            u32 i = rand_r(&seed) % r->n_patterns;
+            u64 backendsets = domain_trie_search(r->dt, &r->domains[i * max_len]);
+            if (i < r->n_patterns / 2)
+                assert(backendsets == i);
+            else
+                assert(backendsets == i || backendsets == DOMAIN_TRIE_NO_MATCH);
+        }
+        domain_trie_read_unlock(r->dt, reader);
+        r->lookups += 64;
+    }
+
+    domain_trie_reader_unregister(r->dt, reader);
+    return NULL;
+}
+
+/*
+ * Reader threads look up a stable half of the patterns, which must always
+ * match, and a churned half, which may match or miss but must never return
+ * anything else, while this thread keeps inserting and deleting the churned
+ * half from a trie that starts empty, so pools, arenas and the edge filter
+ * grow under them.
+ */
+void check_concurrent_readers(char *domains)
+{
+    stress_reader_t readers[STRESS_READERS];
+    volatile int stop = 0;
+    domain_trie_t dt;
+    u32 n = clib_min(count, 100000);
+    u32 rounds = 0;
+    u64 lookups = 0;
+
+    domain_trie_init(&dt);
+    domain_trie_enable_readers(&dt);
+    domain_trie_enable_filter(&dt);
+
+    for (u32 i = 0; i < n / 2; i++)
+        assert(domain_trie_insert(&dt, &domains[i * max_len], i) == 0);
+
+    for (int t = 0; t < STRESS_READERS; t++) {
+        readers[t] = (stress_reader_t){ .dt = &dt, .domains = domains, .n_patterns = n, .stop = &stop };
+        assert(pthread_create(&readers[t].thread, NULL, stress_reader, &readers[t]) == 0);
+    }
+
+    for (f64 end = time_now() + STRESS_SECONDS; time_now() < end; rounds++) {
+        for (u32 i = n / 2; i < n; i++)
+            assert(domain_trie_insert(&dt, &domains[i * max_len], i) == 0);
+        for (u32 i = n / 2; i < n; i++)
+            assert(domain_trie_delete(&dt, &domains[i * max_len]) == 0);
+    }
+
+    stop = 1;
+    for (int t = 0; t < STRESS_READERS; t++) {
+        pthread_join(readers[t].thread, NULL);
+        lookups += readers[t].lookups;
+    }
+
+    domain_trie_reclaim(&dt);
+    assert(vec_len(dt.dict->retired) == 0);
+
+    fformat(stderr, "concurrent readers: %u threads, %llu lookups during %u writer rounds\n",
+            STRESS_READERS, lookups, rounds);
+    domain_trie_free(&dt);
+}
+
+int dump_labels_kv(BVT(clib_bihash_kv) *kv, void *args)
 {
     domain_trie_t *dt = args;
-    u32 *idxs = (u32 *)kv->value;
-    u32 *idx = 0;
-    vec_foreach(idx, idxs) {
-        hash_value_t *value = &dt->pool_backendsets[*idx];
-        fformat(stderr, "%llu %v %llu", kv->key, value->data, value->backendsets);
+    u32 idx = kv->value;
+    while (idx != DOMAIN_TRIE_INVALID_INDEX) {
+        domain_trie_label_t *label = &dt->dict->pool_labels[idx];
+        fformat(stderr, "%llu %.*s %u", kv->key, label->len, domain_trie_label_data(dt, label), label->counter);
+        idx = label->next;
     }
     fformat(stderr, "\n\n");
     return 1;
 }
 
-void dump_back_table(domain_trie_t *dt)
+void dump_labels_table(domain_trie_t *dt)
 {
-    BV(clib_bihash_foreach_key_value_pair)(&dt->backendsets, dump_back_kv, (void *)dt);
+    BV(clib_bihash_foreach_key_value_pair)(&dt->dict->labels, dump_labels_kv, (void *)dt);
 }
 
 int dump_trie_kv(BVT(clib_bihash_kv) *kv, void *args)
 {
     domain_trie_t *dt = args;
-    u32 *idxs = (u32 *)kv->value;
-    u32 *idx = 0;
-    vec_foreach(idx, idxs) {
-        hash_value_t *value = &dt->pool_trie[*idx];
-        fformat(stderr, "%llu %v %llu", kv->key, value->data, value->counter);
-    }
-    fformat(stderr, "\n\n");
+    domain_trie_node_t *node = &dt->nodes[kv->value];
+    domain_trie_label_t *label = &dt->dict->pool_labels[(u32)kv->key];
+    fformat(stderr, "%u %.*s -> %llu %llu %u\n", (u32)(kv->key >> 32), label->len,
+            domain_trie_label_data(dt, label), kv->value, node->backendsets, node->counter);
     return 1;
 }
 
@@ -87,6 +810,18 @@ void dump_trie_table(domain_trie_t *dt)
     BV(clib_bihash_foreach_key_value_pair)(&dt->trie, dump_trie_kv, (void *)dt);
 }
 
+u64 count_patterns(domain_trie_t *dt)
+{
+    domain_trie_node_t *node;
+    u64 a = 0;
+
+    pool_foreach(node, dt->nodes) {
+        a += node->backendsets != DOMAIN_TRIE_NO_MATCH;
+    }
+
+    return a;
+}
+
 void generate_domains(char *domain)
 {
     const char charset[] = "abcdefghijklmnopqrstuvwxyz0123456789-";
@@ -104,32 +839,210 @@ void generate_domains(char *domain)
     domain[pos] = '\0';
 }
 
-int run()
+#define IPRTREE_CHURN 100000
+#define IPRTREE_MAX_THREADS 16
+
+#define IPRTREE_MISS ((u64)-1)
+#define IPRTREE_EXACT_EVERY 100
+#define IPRTREE_ROOT_TARGET (2 * count)
+
+/*
+ * The shape of an iprtree, depth first: for every node its depth, the
+ * converted char leading to it, and its skip string and children or its
+ * target. The node indices go in too when with_indices is set.
+ */
+static u8 *iprtree_shape(iprtree_container_t *container, iprtree_t *tree, int with_indices)
+{
+    iprtree_iterator_t it;
+    u8 *shape = 0;
+
+    iprtree_foreach_node(it, container, tree) {
+        iprtree_node_index_t ni = iprtree_iterator_get_current(&it);
+        iprtree_node_t *node = iprtree_node_at_index(container, ni);
+        u32 depth = vec_len(it.current);
+
+        shape = format(shape, "%u %d", depth, depth > 1 ? vec_end(it.sibling_index)[-1] : -1);
+        if (with_indices)
+            shape = format(shape, " #%u", ni);
+        if (node->type == IPRTREE_NODE_TYPE_LEAF) {
+            shape = format(shape, " -> %u\n", node->target);
+        } else {
+            shape = format(shape, " '");
+            vec_add(shape, iprtree_node_skip_str(container, node), node->n_skip);
+            shape = format(shape, "' %llx\n", node->bitmap);
+        }
+    }
+    return shape;
+}
+
+#define IPRTREE_BUILD_PATTERNS 100000
+
+/* Prepared patterns by reversed string, the order iprtree_build() sorts in */
+static int cmp_reversed(const void *a, const void *b)
+{
+    const iprtree_pattern_t *p1 = a, *p2 = b;
+    uword l1 = vec_len(p1->str), l2 = vec_len(p2->str);
+
+    for (uword i = 0; i < l1 && i < l2; i++)
+        if (p1->str[l1 - 1 - i] != p2->str[l2 - 1 - i])
+            return (int)p1->str[l1 - 1 - i] - (int)p2->str[l2 - 1 - i];
+    return (l1 > l2) - (l1 < l2);
+}
+
+/*
+ * iprtree_build() against iprtree_insert_pattern() of the same patterns in
+ * sorted order: the trees must match down to the node indices. Exact
+ * patterns, wildcards, wildcards over the suffix of another pattern and the
+ * root wildcard are mixed.
+ */
+void check_iprtree_build(char *domains)
+{
+    u32 n = clib_min(count, IPRTREE_BUILD_PATTERNS);
+    iprtree_container_t built = {0}, inserted = {0};
+    iprtree_t built_tree, inserted_tree;
+    iprtree_pattern_t *patterns = 0, *p;
+
+    for (u32 i = 0; i < n; i++) {
+        char *domain = &domains[i * max_len];
+
+        vec_add2(patterns, p, 1);
+        p->str = sniproxy_prepare_pattern(format(0, i % 3 ? "*.%s" : "%s", domain));
+        p->target = i;
+        if (i % 7 == 0) {
+            vec_add2(patterns, p, 1);
+            p->str = sniproxy_prepare_pattern(format(0, "*.%s", strchr(domain, '.') + 1));
+            p->target = count + i;
+        }
+    }
+    vec_add2(patterns, p, 1);
+    p->str = sniproxy_prepare_pattern(format(0, "*"));
+    p->target = 2 * count;
+
+    built_tree.iprtree_root_node_index = iprtree_allocate_internal_node(&built);
+    assert(iprtree_build(&built, &built_tree, patterns) == 0);
+
+    qsort(patterns, vec_len(patterns), sizeof(patterns[0]), cmp_reversed);
+    inserted_tree.iprtree_root_node_index = iprtree_allocate_internal_node(&inserted);
+    vec_foreach(p, patterns) {
+        int rv = iprtree_insert_pattern(&inserted, &inserted_tree, p->str, p->target);
+        assert(rv == 0);
+    }
+
+    u8 *a = iprtree_shape(&built, &built_tree, 1);
+    u8 *b = iprtree_shape(&inserted, &inserted_tree, 1);
+    assert(pool_elts(built.nodes) == pool_elts(inserted.nodes));
+    assert(vec_is_equal(a, b));
+    vec_free(a);
+    vec_free(b);
+
+    vec_foreach(p, patterns)
+        vec_free(p->str);
+    vec_free(patterns);
+    iprtree_container_free(&built);
+    iprtree_container_free(&inserted);
+}
+
+/*
+ * Every lookup the iprtree section sets up: the wildcard of each domain,
+ * the exact pattern of every IPRTREE_EXACT_EVERY-th one, and the root
+ * wildcard for names nothing else matches.
+ */
+static void check_iprtree_search(sniproxy_main_t *sm, char *domains)
+{
+    for (u32 i = 0; i < count; i++) {
+        u8 *name = format(0, "1.%s%c", &domains[i * max_len], 0);
+        assert(domain_iprtree_search(sm, (const char *)name) == i);
+        vec_free(name);
+        if (i % IPRTREE_EXACT_EVERY == 0)
+            assert(domain_iprtree_search(sm, &domains[i * max_len]) == count + i);
+    }
+    assert(domain_iprtree_search(sm, "no.such.name") == IPRTREE_ROOT_TARGET);
+}
+
+static const char *nested_queries[] = {
+    "x.b.a.com", "y.b.a.com", "z.y.b.a.com", "b.a.com", "q.a.com", "a.com", "other.net",
+};
+
+typedef struct {
+    char op; /* '+' add, '-' delete, 'i' insert for the next commit */
+    const char *pattern;
+    u64 backendsets;
+    u64 expected[ARRAY_LEN(nested_queries)];
+} nested_step_t;
+
+/*
+ * Nested patterns changed one at a time on the live tree. Deleting the more
+ * specific of two gives its lookups back to the covering wildcard, and
+ * deleting the covering one leaves the covered ones alone. Every step is
+ * checked on the live tree, then again on a full commit of the same
+ * patterns, which the next step changes in turn.
+ */
+void check_iprtree_nested(void)
+{
+    static const nested_step_t steps[] = {
+        { '+', "*.a.com", 1, { 1, 1, 1, 1, 1, IPRTREE_MISS, IPRTREE_MISS } },
+        { '+', "*.b.a.com", 2, { 2, 2, 2, 1, 1, IPRTREE_MISS, IPRTREE_MISS } },
+        { '+', "x.b.a.com", 3, { 3, 2, 2, 1, 1, IPRTREE_MISS, IPRTREE_MISS } },
+        { '+', "*", 4, { 3, 2, 2, 1, 1, 4, 4 } },
+        { '-', "x.b.a.com", 0, { 2, 2, 2, 1, 1, 4, 4 } },
+        { '-', "*.b.a.com", 0, { 1, 1, 1, 1, 1, 4, 4 } },
+        { '+', "x.b.a.com", 3, { 3, 1, 1, 1, 1, 4, 4 } },
+        { '-', "*.a.com", 0, { 3, 4, 4, 4, 4, 4, 4 } },
+        { '+', "*.Y.b.a.com.", 5, { 3, 4, 5, 4, 4, 4, 4 } },
+        { '+', "*.y.b.a.com", 6, { 3, 4, 6, 4, 4, 4, 4 } },
+        { '-', "*", 0, { 3, IPRTREE_MISS, 6, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS } },
+        { 'i', "*.a.com", 7, { 3, IPRTREE_MISS, 6, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS } },
+        { '-', "*.a.com", 0, { 3, IPRTREE_MISS, 6, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS } },
+        { '-', "*.y.b.a.com", 0, { 3, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS,
+                                   IPRTREE_MISS } },
+        { '-', "x.b.a.com", 0, { IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS, IPRTREE_MISS,
+                                 IPRTREE_MISS, IPRTREE_MISS } },
+    };
+    sniproxy_main_t sm = {0};
+
+    domain_iprtree_init(&sm);
+    for (int i = 0; i < ARRAY_LEN(steps); i++) {
+        const nested_step_t *step = &steps[i];
+        int rv = step->op == '+' ? domain_iprtree_add(&sm, step->pattern, step->backendsets) :
+                 step->op == 'i' ? domain_iprtree_insert(&sm, step->pattern, step->backendsets) :
+                                   domain_iprtree_delete(&sm, step->pattern);
+        assert(rv == 0);
+
+        for (int pass = 0; pass < 2; pass++) {
+            for (int j = 0; j < ARRAY_LEN(nested_queries); j++)
+                assert(domain_iprtree_search(&sm, nested_queries[j]) == step->expected[j]);
+            if (step->op != 'i')
+                domain_iprtree_commit(&sm);
+        }
+    }
+
+    /* Gone already, and never there */
+    assert(domain_iprtree_delete(&sm, "x.b.a.com") < 0);
+    assert(domain_iprtree_delete(&sm, "*.b.a.com") < 0);
+    assert(domain_iprtree_add(&sm, "a.*.com", 1) < 0);
+    assert(domain_iprtree_search(&sm, "a.x.com") == IPRTREE_MISS);
+}
+
+#define RUN_TRIE (1 << 0)
+#define RUN_IPRTREE (1 << 1)
+
+int run(int engines)
 {
     struct rusage start_res, end_res;
     struct timeval start_time, end_time;
     srand(arc4random());
-    domain_trie_t dt = {0};
     clib_mem_init(0, 8ULL << 30);
 
-    domain_trie_init(&dt);
-
     char (*domains)[count * max_len + 1] = calloc(count * max_len + 1, sizeof(char));
 
     for (int i = 0; i < count * max_len; i += max_len) {
         generate_domains(&(*domains)[i]);
     }
 
-    /*FILE *file = fopen("data.txt", "w");*/
-
-    /*size_t rc = fwrite((*domains), sizeof(char), count * max_len + 1, file);*/
-    /*exit(0);*/
+    if (engines & RUN_TRIE) {
+        domain_trie_t dt = {0};
+        domain_trie_init_capacity(&dt, count, DOMAIN_TRIE_LOAD_FACTOR);
 
-    /*FILE *file = fopen("data.txt", "r");*/
-    /*size_t rc = fread(&(*domains), sizeof(char), count * max_len + 1, file);*/
-    /*fclose(file);*/
-
-    if (1) {
         getrusage(RUSAGE_SELF, &start_res);
         gettimeofday(&start_time, NULL);
 
@@ -146,6 +1059,14 @@ int run()
         u64 all_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000L;
         fformat(stderr,"inserting %llu patterns: time: %llu sec, memory: %llu KB\n\n", count, all_time, all_mem);
 
+        domain_trie_hash_stats_t stats;
+        domain_trie_hash_stats(&dt, &stats);
+        fformat(stderr, "%U\n", format_domain_trie_hash_stats, &stats);
+
+        domain_trie_stats_t mem;
+        domain_trie_stats(&dt, &mem);
+        fformat(stderr, "%U\n", format_domain_trie_stats, &mem);
+
         gettimeofday(&start_time, NULL);
         for (int i = 0; i < count * max_len; i += max_len) {
             u64 backendsets = domain_trie_search(&dt, &(*domains)[i]);
@@ -156,7 +1077,21 @@ int run()
         all_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000L;
         fformat(stderr,"sarching %llu patterns: time: %llu sec\n", count, all_time);
 
-        u64 k = count_kv_table(&dt.backendsets);
+        check_search_allocations(&dt, *domains);
+        check_delete_churn(&dt, *domains);
+        bench_search_batch(&dt, *domains);
+        bench_search_pipelined();
+        bench_search_frozen(&dt, *domains);
+        bench_load_file(*domains);
+        bench_journal_restart(*domains);
+        check_journal_append_failure(*domains);
+        bench_junk_filter(&dt, *domains);
+        bench_search_cache(&dt, *domains);
+        check_shared_dict(*domains);
+        bench_label_hash();
+        check_concurrent_readers(*domains);
+
+        u64 k = count_patterns(&dt);
         assert(k == count);
 
         int rc = domain_trie_insert(&dt, "*.cisco.io", 12);
@@ -165,8 +1100,25 @@ int run()
         u64 backendsets = domain_trie_search(&dt, "1.cisco.io");
         assert(backendsets == 12);
 
-    } else {
+        domain_trie_frozen_t *ft = domain_trie_freeze(&dt);
+        assert(domain_trie_search_frozen(ft, (const u8 *)"1.Cisco.io", 10) == 12);
+        assert(domain_trie_search_frozen(ft, (const u8 *)"cisco.io", 8) == DOMAIN_TRIE_NO_MATCH);
+        domain_trie_frozen_free(ft);
+
+        /* Lookups are lowercased, lose the root dot and reject junk */
+        assert(domain_trie_search(&dt, "1.Cisco.IO.") == 12);
+        assert(domain_trie_search(&dt, "1.cisco.io..") == DOMAIN_TRIE_NO_MATCH);
+        assert(domain_trie_search(&dt, "1_1.cisco.io") == DOMAIN_TRIE_NO_MATCH);
+        assert(domain_trie_search(&dt, "1.cisco.io/") == DOMAIN_TRIE_NO_MATCH);
+
+        domain_trie_free(&dt);
+    }
+
+    if (engines & RUN_IPRTREE) {
         // iprtree
+        check_iprtree_nested();
+        check_iprtree_build(*domains);
+
         sniproxy_main_t sm = {0};
         domain_iprtree_init(&sm);
 
@@ -176,8 +1128,10 @@ int run()
 
 
         for (int i = 0; i < count * max_len; i += max_len) {
-            u8 *pattern = format(0, "*.%s", &(*domains)[i]);
-            domain_iprtree_insert(&sm, (const char *)pattern, i / max_len);
+            u8 *pattern = format(0, "*.%s%c", &(*domains)[i], 0);
+            int rc = domain_iprtree_insert(&sm, (const char *)pattern, i / max_len);
+            assert(rc == 0);
+            vec_free(pattern);
         }
 
         getrusage(RUSAGE_SELF, &end_res);
@@ -188,6 +1142,14 @@ int run()
         u64 all_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000L;
         fformat(stderr,"inserting %llu patterns: time: %llu sec, memory: %llu KB\n", count, all_time, all_mem);
 
+        /* Exact patterns next to some of the wildcards, and the root
+         * wildcard, which a parallel commit leaves to the calling thread */
+        for (int i = 0; i < count; i += IPRTREE_EXACT_EVERY) {
+            int rc = domain_iprtree_insert(&sm, &(*domains)[i * max_len], count + i);
+            assert(rc == 0);
+        }
+        assert(domain_iprtree_insert(&sm, "*", IPRTREE_ROOT_TARGET) == 0);
+
         getrusage(RUSAGE_SELF, &start_res);
         gettimeofday(&start_time, NULL);
 
@@ -199,26 +1161,105 @@ int run()
         all_mem = end_res.ru_maxrss - start_res.ru_maxrss;
         all_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000L;
         fformat(stderr,"building tree for %llu patterns: time: %llu sec, memory: %llu KB\n", count, all_time, all_mem);
+        fformat(stderr, "iprtree: %u nodes, %llu KB\n", pool_elts(sm.iprtree_container.nodes),
+                iprtree_memory_size(&sm.iprtree_container) >> 10);
 
-        gettimeofday(&start_time, NULL);
+        /* Same tree built by several threads: same shape, same lookups */
+        iprtree_t *tree = &sniproxy_table_get(&sm, 0)->tree;
+        u32 n_nodes = pool_elts(sm.iprtree_container.nodes);
+        u8 *serial = iprtree_shape(&sm.iprtree_container, tree, 0);
+        check_iprtree_search(&sm, *domains);
+        for (u32 n_threads = 2; n_threads <= IPRTREE_MAX_THREADS; n_threads *= 2) {
+            f64 t = time_now();
+            domain_iprtree_commit_parallel(&sm, n_threads);
+            fformat(stderr, "parallel commit, %u threads: %.3f sec\n", n_threads, time_now() - t);
+            assert(pool_elts(sm.iprtree_container.nodes) == n_nodes);
+            u8 *shape = iprtree_shape(&sm.iprtree_container, tree, 0);
+            assert(vec_is_equal(shape, serial));
+            vec_free(shape);
+            check_iprtree_search(&sm, *domains);
+        }
+        vec_free(serial);
+
+        f64 start = time_now();
         int i = 0;
         for (i = 0; i < count * max_len; i += max_len) {
-            u8 *pattern = format(0, "1.%s", &(*domains)[i]);
+            u8 *pattern = format(0, "1.%s%c", &(*domains)[i], 0);
             u64 backendsets = domain_iprtree_search(&sm, (const char*)pattern);
             assert(backendsets == i / max_len);
+            vec_free(pattern);
         }
-        gettimeofday(&end_time, NULL);
+        fformat(stderr, "searching %llu patterns: %.1f ns/lookup\n", count, (time_now() - start) * 1e9 / count);
 
-        all_time = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_usec - start_time.tv_usec) / 1000000L;
-        fformat(stderr,"searching %llu patterns: time: %llu sec\n", count, all_time);
+        domain_cache_t cache;
+        domain_cache_init(&cache, DOMAIN_CACHE_LOG2_SETS);
+        for (i = 0; i < count; i++) {
+            u32 hot = rand() % clib_min(count, HOT_DOMAINS);
+            u8 *pattern = format(0, "1.%s%c", &(*domains)[hot * max_len], 0);
+            u64 backendsets = domain_iprtree_search_cached(&sm, &cache, (const char *)pattern);
+            assert(backendsets == hot);
+            vec_free(pattern);
+        }
+        fformat(stderr, "cached search: %U\n", format_domain_cache, &cache);
+        domain_cache_free(&cache);
+
+        /* Lookups below miss once their wildcard is gone */
+        assert(domain_iprtree_delete(&sm, "*") == 0);
+        assert(domain_iprtree_search(&sm, "no.such.name") == IPRTREE_MISS);
 
+        /* Single pattern changes on the live tree, against a full commit */
+        u32 n_churn = clib_min(count, IPRTREE_CHURN);
+        start = time_now();
+        for (i = 0; i < n_churn; i++) {
+            u8 *pattern = format(0, "*.%s%c", &(*domains)[i * max_len], 0);
+            int rv = domain_iprtree_delete(&sm, (const char *)pattern);
+            assert(rv == 0);
+            vec_free(pattern);
+        }
+        f64 deleted = time_now() - start;
+        for (i = 0; i < n_churn; i++) {
+            u8 *pattern = format(0, "1.%s%c", &(*domains)[i * max_len], 0);
+            assert(domain_iprtree_search(&sm, (const char *)pattern) == (u64)-1);
+            vec_free(pattern);
+        }
+        start = time_now();
+        for (i = 0; i < n_churn; i++) {
+            u8 *pattern = format(0, "*.%s%c", &(*domains)[i * max_len], 0);
+            int rv = domain_iprtree_add(&sm, (const char *)pattern, i);
+            assert(rv == 0);
+            vec_free(pattern);
+        }
+        f64 added = time_now() - start;
+        for (i = 0; i < n_churn; i++) {
+            u8 *pattern = format(0, "1.%s%c", &(*domains)[i * max_len], 0);
+            assert(domain_iprtree_search(&sm, (const char *)pattern) == i);
+            vec_free(pattern);
+        }
+        start = time_now();
+        domain_iprtree_commit(&sm);
+        fformat(stderr, "iprtree churn: delete %.2f us, add %.2f us per pattern, full commit %.3f sec\n",
+                deleted * 1e6 / n_churn, added * 1e6 / n_churn, time_now() - start);
     }
 
     free(domains);
     return EXIT_SUCCESS;
 }
 
-int main()
+int main(int argc, char **argv)
 {
-    return run();
+    int engines = RUN_TRIE | RUN_IPRTREE;
+
+    /* "trie" or "iprtree" runs only that one, both run by default */
+    if (argc > 1) {
+        if (!strcmp(argv[1], "trie")) {
+            engines = RUN_TRIE;
+        } else if (!strcmp(argv[1], "iprtree")) {
+            engines = RUN_IPRTREE;
+        } else {
+            fprintf(stderr, "usage: %s [trie|iprtree]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return run(engines);
 }
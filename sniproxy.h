@@ -81,6 +81,8 @@ typedef struct
   u32 n_instances;
   iprtree_t tree;
   u32 *pattern_indices; /* vec */
+  uword *pattern_by_str; /* hash: prepared pattern -> pattern_indices slot */
+  u64 generation;	 /* bumped on every change, keys domain_cache_t */
 } sniproxy_table_t;
 
 typedef struct